@@ -0,0 +1,113 @@
+#ifndef ENGINE_ATOM_H
+#define ENGINE_ATOM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace Engine
+{
+    /*
+    An interned string. Every atom made from the same text points at the same entry in a global table, so comparing, copying and hashing them is as cheap as an integer.
+    Entries are never freed, so use these for names (tags, classes, ids, attributes), not for arbitrary data.
+    Making one from text takes a lock, so hot code should make its atoms once and keep them
+    */
+    class Atom
+    {
+        public:
+            struct Entry
+            {
+                std::string text;
+                uint32_t id;
+            };
+
+        private:
+            const Entry* entry;
+
+            static const Entry* getEmptyEntry();
+            static const Entry* intern(const std::string& text, bool create);
+
+            Atom(const Entry* existing)
+            : entry(existing)
+            {
+
+            }
+
+        public:
+            // The empty string
+            Atom()
+            : entry(getEmptyEntry())
+            {
+
+            }
+
+            // These are explicit so strings don't get interned by accident when they're only being looked up
+            explicit Atom(const std::string& text)
+            : entry(intern(text, true))
+            {
+
+            }
+
+            explicit Atom(const char* text)
+            : entry(intern(text, true))
+            {
+
+            }
+
+            // Returns the atom for text if something's already interned it, or the empty atom if not. Use this for lookups so they don't fill the table up
+            static Atom find(const std::string& text)
+            {
+                return Atom(intern(text, false));
+            }
+
+            const std::string& str() const
+            {
+                return entry->text;
+            }
+
+            // Small numbers handed out in the order atoms are made. The empty atom is 0
+            uint32_t getId() const
+            {
+                return entry->id;
+            }
+
+            bool empty() const
+            {
+                return entry->id == 0;
+            }
+
+            bool operator==(const Atom& other) const
+            {
+                return entry == other.entry;
+            }
+
+            bool operator!=(const Atom& other) const
+            {
+                return entry != other.entry;
+            }
+
+            // Orders by id, not alphabetically
+            bool operator<(const Atom& other) const
+            {
+                return entry->id < other.entry->id;
+            }
+
+            // How many atoms there are, including the empty one
+            static size_t getAtomCount();
+    };
+}
+
+namespace std
+{
+    template<>
+    struct hash<Engine::Atom>
+    {
+        size_t operator()(const Engine::Atom& atom) const noexcept
+        {
+            return std::hash<uint32_t>()(atom.getId());
+        }
+    };
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include "Engine/Renderer/Renderer.hpp"
 #include "glm/fwd.hpp"
 #include <glm/glm.hpp>
+#include <atomic>
 #include <math.h>
 #include <memory>
 #include <mutex>
@@ -55,15 +56,43 @@ namespace Engine
 
             protected:
                 glm::mat4 transform;
-                std::mutex transform_lock;
+                mutable std::mutex transform_lock;
                 
                 glm::mat4 global_transform;
-                std::mutex global_transform_lock;
+                mutable std::mutex global_transform_lock;
+
+                // Set when the local transform changes. The children get updated during the transform phase of the next tick
+                std::atomic<bool> transform_dirty;
+
+                // Set when it's been given a new parent, so its global transform needs working out again
+                std::atomic<bool> reparented{false};
+
+                // The local transform as it was before the step it last changed in, and that step's number. See Document::setFixedTimestep
+                glm::mat4 previous_transform;
+                glm::uint64 transform_step;
+                glm::uint64 created_step;
+
+                // Where to draw this element, between the last two steps. Only set while render_interpolated is, otherwise the real transforms are drawn.
+                // These are written in the transform phase, so render() doesn't need a lock to read them
+                glm::mat4 render_transform;
+                glm::mat4 render_global_transform;
+                bool render_interpolated = false;
+                bool was_blending = false;
+
+                // Keeps hold of the transform from before this step. Call it with transform_lock held, before changing transform
+                void saveStepTransform();
+
+                // Works out render_transform and render_global_transform for this tick
+                void updateRenderTransform(bool blending);
             public:
                 Element3D(std::shared_ptr<Document> parent_document);
                 glm::mat4 getTransform() const;
                 glm::mat4 getGlobalTransform() const;
 
+                // The transforms to draw this element with. With a fixed timestep these are partway between the last two steps, otherwise they're the same as above
+                glm::mat4 getRenderTransform() const;
+                glm::mat4 getRenderGlobalTransform() const;
+
                 // This tells this element that it's parent has been updated, and it must update it's position accordingly
                 void updateGlobalTransform();
 
@@ -84,10 +113,18 @@ namespace Engine
 
                 void setTransform(glm::mat4 trans);
 
-                // This tells all this element's children to update their positions. This should be called after 
-                // you modify the transformation matricies yourself
+                // This tells all this element's children to update their positions right away.
+                // Moving an element with translate, rotate, etc. updates the children automatically at the end of process, so you only need this if you need them updated immediately
                 void callChildUpdate();
 
+                // Marks this element as moved, so its children get updated before anything renders. Call this after you modify the transformation matricies yourself
+                void markTransformDirty()
+                {
+                    transform_dirty = true;
+                }
+
+                virtual bool propagateTransform(bool parent_changed);
+
                 // Tells the devtools orbit camera to target this element
                 // This should *only* be called while devtools is open
                 void devtoolsOrbit();
@@ -95,7 +132,6 @@ namespace Engine
                 virtual void onLoad();
                 virtual void onSave();
 
-                virtual void appendChild(std::shared_ptr<DOM::Element> elem);
                 virtual void onParentAdded();
 
         };
@@ -171,6 +207,12 @@ namespace Engine
                     document->renderer->addLight(std::dynamic_pointer_cast<LightElement3D>(shared_from_this()));
                 };
 
+                // What the renderer needs to draw with this light, as of this frame
+                Renderer::LightData getLightData() const
+                {
+                    return Renderer::LightData {getRenderGlobalTransform() * getRenderTransform() * glm::vec4(0,0,0,1), ambient, intensity, radius};
+                }
+
                 virtual void onSave()
                 {
                     // setAttribute("diffuse", vectorToString(diffuse));
@@ -198,6 +240,46 @@ namespace Engine
 
         class MeshMaterial: public Renderer::UniformObject
         {
+            private:
+                static const int max_lights = 32;
+
+                // The uniform names are built once, instead of every time an object is drawn
+                struct LightUniformNames
+                {
+                    std::string position;
+                    std::string diffuse;
+                    std::string ambient;
+                    std::string specular;
+                    std::string intensity;
+                    std::string radius;
+                    std::string attenv;
+                    std::string exists;
+                };
+
+                static const LightUniformNames* getLightUniformNames()
+                {
+                    static const std::vector<LightUniformNames> names = []() {
+                        std::vector<LightUniformNames> output;
+                        for (int i = 0; i < max_lights; i++)
+                        {
+                            std::string light = "light[" + std::to_string(i) + "].";
+                            output.push_back(LightUniformNames {light + "position", light + "diffuse", light + "ambient", light + "specular",
+                                light + "intensity", light + "radius", light + "attenv", light + "exists"});
+                        }
+                        return output;
+                    }();
+                    return names.data();
+                }
+
+                inline static const std::string uniform_shading_mode = "shading_mode";
+                inline static const std::string uniform_diffuse = "material.diffuse";
+                inline static const std::string uniform_ambient = "material.ambient";
+                inline static const std::string uniform_specular = "material.specular";
+                inline static const std::string uniform_shininess = "material.shininess";
+                inline static const std::string uniform_rough = "material.rough";
+                inline static const std::string uniform_metal = "material.metal";
+                inline static const std::string uniform_color = "material.color";
+
             public:
                 // Colour of the material (will be overriden by textures)
                 glm::vec3 diffuse;
@@ -228,62 +310,46 @@ namespace Engine
                 // Needed for shapes with holes in them
                 // bool two_sided;
 
-                virtual void setUniforms(std::shared_ptr<Renderer::ShaderProgram> sp, std::shared_ptr<Renderer::RenderObject> re, std::vector<std::shared_ptr<LightElement3D>> lights, glm::mat4 global_position)
+                virtual void setUniforms(std::shared_ptr<Renderer::ShaderProgram> sp, std::shared_ptr<Renderer::RenderObject> re, const std::vector<Renderer::LightData>& lights, glm::mat4 global_position)
                 {
                     // Setting shader uniforms goes here
+                    const LightUniformNames* names = getLightUniformNames();
                     int on_num = 0;
 
                     // TODO: Default lights
                     // TODO: Detect if only half of an object needs to be shaded
 
-                    // Find every light that effects this object
-                    for (int i = 0; i < lights.size(); i++) {
-                        // if (i > lights.size()-1)
-                        // {
-                        //     sp->setUniform("light["+std::to_string(i)+"].position", glm::vec4(0, 0, 2, 1));
-
-                        //     // Diffuse, ambient, and specular, of light
-                        //     sp->setUniform("light["+std::to_string(i)+"].diffuse", glm::vec3(0.5, 0.5, 0.5));
-                        //     sp->setUniform("light["+std::to_string(i)+"].ambient", glm::vec3(0.5, 0.5, 0.5));
-                        //     sp->setUniform("light["+std::to_string(i)+"].specular", glm::vec3(0.5, 0.5, 0.5));
-                        //     sp->setUniform("light["+std::to_string(i)+"].radius", 0);
-
-                        //     // Set existance
-                        //     sp->setUniform("light["+std::to_string(i)+"].exists", 0);
-
-                        //     continue;
-                        // }
-                        
-                        auto lpos = lights[i]->getGlobalTransform() * lights[i]->getTransform() * glm::vec4(0,0,0,1);
+                    // Find every light that effects this object. They're packed into the first slots, so the rest can be switched off below
+                    for (size_t i = 0; i < lights.size(); i++) {
+                        const glm::vec4& lpos = lights[i].position;
 
-                        if (glm::distance(lpos, global_position * glm::vec4(0, 0, 0, 1)) <= lights[i]->radius)
+                        if (glm::distance(lpos, global_position * glm::vec4(0, 0, 0, 1)) <= lights[i].radius)
                         {
                             // Within radius
-                            sp->setUniform("light["+std::to_string(i)+"].position", lpos);
+                            const LightUniformNames& light = names[on_num];
+                            sp->setUniform(light.position, lpos);
 
                             // Diffuse, ambient, and specular, of light
-                            // sp->setUniform("light["+std::to_string(i)+"].diffuse", lights[i]->diffuse);
-                            sp->setUniform("light["+std::to_string(i)+"].ambient", lights[i]->ambient);
-                            // sp->setUniform("light["+std::to_string(i)+"].specular", lights[i]->specular);
-                            sp->setUniform("light["+std::to_string(i)+"].intensity", lights[i]->intensity);
-                            sp->setUniform("light["+std::to_string(i)+"].radius", lights[i]->radius);
+                            sp->setUniform(light.ambient, lights[i].ambient);
+                            sp->setUniform(light.intensity, lights[i].intensity);
+                            sp->setUniform(light.radius, lights[i].radius);
 
                             if (shading_mode == ShadingMode::Fragment)
                             {
-                                sp->setUniform("shading_mode", 1);
-                                sp->setUniform("light["+std::to_string(i)+"].attenv", 1.0f - glm::distance(global_position * glm::vec4(0, 0, 0, 1), lpos)/lights[i]->radius);
+                                sp->setUniform(uniform_shading_mode, 1);
+                                sp->setUniform(light.attenv, 1.0f - glm::distance(global_position * glm::vec4(0, 0, 0, 1), lpos)/lights[i].radius);
                             }
                             else
                             {
                                 // For vertex shading, we do this per vertex
                                 // Which looks better
                                 // But that's not viable per fragment
-                                sp->setUniform("light["+std::to_string(i)+"].attenv", 0.0f);
-                                sp->setUniform("shading_mode", 0);
+                                sp->setUniform(light.attenv, 0.0f);
+                                sp->setUniform(uniform_shading_mode, 0);
                             }
 
                             // Set existance
-                            sp->setUniform("light["+std::to_string(i)+"].exists", 1);
+                            sp->setUniform(light.exists, 1);
 
                             on_num ++;
                             if (on_num > 31)
@@ -293,30 +359,31 @@ namespace Engine
                         }
                     }
 
-                    for (int i = on_num; i < 32; i++)
+                    for (int i = on_num; i < max_lights; i++)
                     {
-                        sp->setUniform("light["+std::to_string(i)+"].position", glm::vec4(0, 0, 2, 1));
+                        const LightUniformNames& light = names[i];
+                        sp->setUniform(light.position, glm::vec4(0, 0, 2, 1));
 
                         // Diffuse, ambient, and specular, of light
-                        sp->setUniform("light["+std::to_string(i)+"].diffuse", glm::vec3(0.5, 0.5, 0.5));
-                        sp->setUniform("light["+std::to_string(i)+"].ambient", glm::vec3(0.5, 0.5, 0.5));
-                        sp->setUniform("light["+std::to_string(i)+"].specular", glm::vec3(0.5, 0.5, 0.5));
-                        sp->setUniform("light["+std::to_string(i)+"].radius", 0);
+                        sp->setUniform(light.diffuse, glm::vec3(0.5, 0.5, 0.5));
+                        sp->setUniform(light.ambient, glm::vec3(0.5, 0.5, 0.5));
+                        sp->setUniform(light.specular, glm::vec3(0.5, 0.5, 0.5));
+                        sp->setUniform(light.radius, 0);
 
                         // Set existance
-                        sp->setUniform("light["+std::to_string(i)+"].exists", 0);
+                        sp->setUniform(light.exists, 0);
                     }
 
                     // Material stuff
-                    sp->setUniform("material.diffuse", diffuse);
-                    sp->setUniform("material.ambient", ambient);
-                    sp->setUniform("material.specular", specular);
-                    sp->setUniform("material.shininess", shininess);
+                    sp->setUniform(uniform_diffuse, diffuse);
+                    sp->setUniform(uniform_ambient, ambient);
+                    sp->setUniform(uniform_specular, specular);
+                    sp->setUniform(uniform_shininess, shininess);
 
                     // PBR Material stuff
-                    sp->setUniform("material.rough", rough);
-                    sp->setUniform("material.metal", metal ? 1 : 0);
-                    sp->setUniform("material.color", color);
+                    sp->setUniform(uniform_rough, rough);
+                    sp->setUniform(uniform_metal, metal ? 1 : 0);
+                    sp->setUniform(uniform_color, color);
                 }
         };
 
@@ -7,7 +7,8 @@
 
 // #include "Engine/DOM.hpp"
 
-// #include "Engine/Threading.hpp"
+#include "Engine/Threading.hpp"
+#include "Engine/Memory.hpp"
 // #include "Engine/Renderer/Renderer.hpp"
 #include <exception>
 #include <iostream>
@@ -16,13 +17,20 @@
 #include <vector>
 
 #include <thread>
+#include <mutex>
+#include <atomic>
 #include <functional>
 #include <variant>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
 
 #include "glm/fwd.hpp"
+#include "glm/mat4x4.hpp"
 #include "Engine/Log.hpp"
+#include "Engine/Atom.hpp"
 
 // So I don't have header hell
 namespace tinyxml2
@@ -35,6 +43,11 @@ namespace Engine
 {
     class Document;
 
+    namespace Scene
+    {
+        class Writer;
+    }
+
     namespace Renderer {
         class IRenderer;
     }
@@ -46,42 +59,76 @@ namespace Engine
 
     namespace Types
     {
-        class TypeContainer
+        /*
+        A set of types. Every element with exactly the same types shares one of these, so there's one per element class rather than one per element.
+        They're made the first time something needs them and never freed
+        */
+        class TypeSet
         {
             private:
-                glm::uint64 storage [8] = {0,0,0,0,0,0,0,0};
+                // Bit n is set if type n is in the set
+                std::vector<glm::uint64> bits;
+
+                // The same types, in the order they were added
+                std::vector<int> types;
+
+                // This set with one more type added, for each type that's been added to it so far. Guarded by a lock in types.cpp
+                mutable std::unordered_map<int, const TypeSet*> extended;
+
             public:
-                void setType(int new_type)
+                bool has(int type) const
                 {
-                    if (new_type > 511)
+                    size_t num = (size_t)type / 64;
+                    if (type < 0 || num >= bits.size())
                     {
-                        LOG_ERROR("Error: Only 511 types are supported");
-                        return;
+                        return false;
                     }
-                    if (isType(new_type))
+                    return (bits[num] >> (type % 64)) & 1U;
+                }
+
+                const std::vector<int>& getTypes() const
+                {
+                    return types;
+                }
+
+                // The set with no types
+                static const TypeSet* getEmpty();
+
+                // Returns this set with `type` added. The same set is returned every time, so it's only made once
+                const TypeSet* with(int type) const;
+        };
+
+        class TypeContainer
+        {
+            private:
+                // Elements can be looked at from other threads while a constructor is still setting their types
+                std::atomic<const TypeSet*> types {TypeSet::getEmpty()};
+            public:
+                void setType(int new_type)
+                {
+                    const TypeSet* current = types.load(std::memory_order_relaxed);
+                    if (current->has(new_type))
                     {
                         // Don't unset ourselves
                         return;
                     }
-                    int num = new_type/64;
-                    int bit = new_type % 64;
+                    types.store(current->with(new_type), std::memory_order_release);
+                }
 
-                    storage[num] |= 1UL << bit;
+                bool isType(int new_type) const
+                {
+                    return types.load(std::memory_order_acquire)->has(new_type);
                 }
 
-                bool isType(int new_type)
+                // Calls `function` with every type that's been set
+                template<typename F>
+                void forEachType(F function) const
                 {
-                    if (new_type > 511)
+                    const std::vector<int>& all = types.load(std::memory_order_acquire)->getTypes();
+                    for (size_t i = 0; i < all.size(); i++)
                     {
-                        LOG_ERROR("Error: Only 511 types are supported");
-                        return false;
+                        function(all[i]);
                     }
-
-                    int num = new_type/64;
-                    int bit = new_type % 64;
-
-                    int value = (storage[num] >> bit) & 1U;
-                    return value;
                 }
         };
 
@@ -89,126 +136,333 @@ namespace Engine
         {
             private:
                 int on;
-                std::map<std::string, int> types;
+
+                // Type ids by atom id. 0 means the name hasn't been given a type yet
+                std::vector<int> types;
+
+                // Elements get created and queried from inside tasks, so this can be called from any thread.
+                // Almost every call is for a name that already has a type, so those only take a shared lock
+                std::shared_mutex lock;
             public:
                 ElementTypes()
                 {
                     on = 0;
-                    types = std::map<std::string, int>();
+                    types = std::vector<int>();
+                }
+
+                int getTypeOfElement(const std::string& element)
+                {
+                    return getTypeOfElement(Atom(element));
                 }
 
-                int getTypeOfElement(std::string element)
+                int getTypeOfElement(Atom element)
                 {
+                    {
+                        std::shared_lock<std::shared_mutex> guard(lock);
+                        if (element.getId() < types.size() && types[element.getId()] != 0)
+                        {
+                            return types[element.getId()];
+                        }
+                    }
+
+                    std::unique_lock<std::shared_mutex> guard(lock);
+
+                    if (element.getId() >= types.size())
+                    {
+                        types.resize(element.getId() + 1, 0);
+                    }
+
                     // Check if it exists
-                    if (types.find(element) == types.end()) {
+                    if (types[element.getId()] == 0) {
                         // We have to create a new type
                         on ++;
-                        types[element] = on;
-                        return on;
-                    }
-                    else
-                    {
-                        return types[element];
+                        types[element.getId()] = on;
                     }
+                    return types[element.getId()];
                 }
         };
     }
 
-    namespace Threading
+    namespace DOM
     {
-        struct Task
+        class Element;
+        class Selector;
+
+        class ClassList
         {
-            std::function<void()> function;
+        private:
+            // Classes are added to the document's class index as they're added here
+            Element* owner;
+
+        public:
+            ClassList(Element* owner);
+            ~ClassList();
+
+            // Sorted by atom id, so has() is a binary search over integers
+            std::vector<Atom> classes;
+
+            void add(const std::string& element_class);
+            void add(Atom element_class);
+            void remove(const std::string& element_class);
+            void remove(Atom element_class);
+            bool has(const std::string& element_class) const;
+            bool has(Atom element_class) const;
         };
 
-        // Static class
-        // class ThreadPool
-        // {
-        // private:
-            // ThreadPool(/* args */);
-            // ~ThreadPool();
+        typedef std::variant<unsigned int, int, float, std::string, glm::mat4> AttrVariant;
 
-            
+        // What saveToFile writes. Document::loadFromFile can tell them apart by themselves. See Scene.hpp for the binary one
+        enum class SceneFormat { xml, binary };
 
-        // public:
-            void startThreads();
-            void threadWorker();
-            void lesserThreadWorker();
-            void cleanup();
+        // A view of an element's children that doesn't copy them. It holds the element's tree lock for as long as it exists,
+        // so that element's children can't be added or removed until it's gone, including from inside the loop
+        class ChildRange
+        {
+            private:
+                std::unique_lock<std::mutex> guard;
+                const std::vector<std::shared_ptr<Element>>& children;
 
-            void waitForCompletion();
+            public:
+                typedef std::vector<std::shared_ptr<Element>>::const_iterator iterator;
 
-            void addTask(std::function<void()> function);
-            void addLesserTask(std::function<void()> function);
-            
-        // };
-    } // namespace Threading
+                ChildRange(std::mutex& lock, const std::vector<std::shared_ptr<Element>>& list)
+                : guard(lock),
+                children(list)
+                {
 
-    namespace DOM
-    {
-        class ClassList
+                }
+
+                iterator begin() const
+                {
+                    return children.begin();
+                }
+
+                iterator end() const
+                {
+                    return children.end();
+                }
+
+                size_t size() const
+                {
+                    return children.size();
+                }
+
+                bool empty() const
+                {
+                    return children.empty();
+                }
+
+                const std::shared_ptr<Element>& operator[](size_t i) const
+                {
+                    return children[i];
+                }
+        };
+
+        /*
+        Goes through every descendant of an element in depth first order (parents before their children) without copying anything.
+        Call skipSubtree() to not go into the current element's children.
+        Nothing is locked between steps, so the tree can be changed while walking it, but anything added or removed from a part that's already been passed won't be seen.
+        Removed elements are kept alive until the end of the frame, so don't keep one of these past that
+
+            for (DOM::TreeIterator it(element); !it.done(); it.next())
+            {
+                if (it->getVisible() == false)
+                {
+                    it.skipSubtree();
+                }
+            }
+        */
+        class TreeIterator
         {
-        private:
-            
-        public:
-            ClassList();
-            ~ClassList();
+            private:
+                struct Level
+                {
+                    Element* element;
+                    size_t next;
+                };
+
+                std::vector<Level> stack;
+                Element* current;
+                bool skip;
+
+                // Moves to the next element, without going into the current one
+                void advance();
+
+            public:
+                TreeIterator(Element* root);
+
+                bool done() const
+                {
+                    return current == nullptr;
+                }
 
-            std::vector<std::string> classes;
+                void next();
 
-            void add(std::string element_class);
-            void remove(std::string element_class);
-            bool has(std::string element_class);
+                void skipSubtree()
+                {
+                    skip = true;
+                }
+
+                Element* get() const
+                {
+                    return current;
+                }
+
+                Element& operator*() const
+                {
+                    return *current;
+                }
+
+                Element* operator->() const
+                {
+                    return current;
+                }
+
+                // How far below the root the current element is. The root's children are 1
+                size_t depth() const
+                {
+                    return stack.size();
+                }
         };
 
-        typedef std::variant<unsigned int, int, float, std::string> AttrVariant;
         class Element: public std::enable_shared_from_this<Element>
         {
         private:
             std::vector<std::shared_ptr<Element>> children;
-            std::map<std::string, AttrVariant> attributes;
+            // Sorted by atom id. Elements only have a handful of attributes, so a binary search over this beats a map
+            std::vector<std::pair<Atom, AttrVariant>> attributes;
 
-            std::shared_ptr<Element> parent;
+            // Weak, so a subtree that's been taken out of the tree doesn't keep itself alive through its children
+            std::weak_ptr<Element> parent;
 
-            bool visible = true;
-            bool do_process = true;
+            // Where this element is in its parent's children, so it can be found without searching. Only changed under the parent's tree lock,
+            // but atomic since hasChild and removeChild read it while holding a different element's lock to check it isn't theirs.
+            // Removing a child while keeping the order doesn't renumber the ones after it, so this can be too high, but never too low
+            mutable std::atomic<size_t> index_in_parent {0};
+
+            // See setKeepChildOrder
+            bool keep_child_order = true;
+
+            // How often process() is called. Only the document changes these, with its schedule lock held. See sleep() and setProcessInterval()
+            std::atomic<bool> sleeping {false};
+            double wake_time = -1;
+            glm::uint32 process_interval = 1;
+            float process_period = 0;
+            double last_process_time = 0;
+
+            // Where this element is in the document's timing wheel, if it's in it
+            glm::int32 wheel_slot = -1;
+            glm::uint32 wheel_position = 0;
+
+            // Returns where child is in children, or children.size() if it isn't there. tree_lock has to be held
+            size_t findChild(const Element* child) const;
+
+            // Guards children and parent, since process() can move elements around from any thread
+            mutable std::mutex tree_lock;
+
+            std::atomic<bool> visible {true};
+            std::atomic<bool> do_process {true};
 
             std::map<std::string, std::function<void()>> devtools_buttons;
 
             tinyxml2::XMLElement* elementToXMLElement(std::shared_ptr<Element> elem, tinyxml2::XMLDocument* doc);
 
+            // Adds this element and everything below it to a binary scene
+            void writeScene(Scene::Writer& writer);
+
+            // Adds just this element to a binary scene and returns its children, which still need writing
+            std::vector<std::shared_ptr<Element>> writeSceneRecord(Scene::Writer& writer);
+
+            // Does the work for getElementsByTagName and getElementsByClassName. `id` is a type id, or a class id if by_class is set.
+            // If `tag` isn't empty only elements with exactly that tag are added
+            template<typename V>
+            void collectIndexed(bool by_class, int id, Atom tag, V& output);
+
+            friend class TreeIterator;
+
+            // Where this element was the last time the document flattened the tree. Only the document uses this
+            friend class Engine::Document;
+            glm::uint32 flat_index = 0;
+
+            // True once the id has been added to the document's index. That can't happen until something owns this element
+            bool id_indexed = false;
+            void indexId();
+
         public:
             Element(std::shared_ptr<Document> parent_document);
             ~Element();
 
             // Get the name used to refer to this tag
-            std::string getTagName();
+            const std::string& getTagName() const
+            {
+                return tag_name.str();
+            }
 
-            // Find an element using the id attribute. This will only look through this element's children, and their children, etc
+            // Same as above, as an atom. Compare these instead of strings
+            Atom getTagAtom() const
+            {
+                return tag_name;
+            }
+
+            // Find an element using the id attribute. This will only look through this element's children, and their children, etc.
+            // Ids are looked up in the document's index, so this only walks the tree if more than one element has the id. Returns nullptr if there isn't one
             std::shared_ptr<Element> getElementById(std::string id);
 
             // Find a vector of elements which are of the tag `tag`. This will only look through this element's children, and their children, etc
             std::vector<std::shared_ptr<Element>> getElementsByTagName(std::string tag, bool derived = false);
 
+            // Same as above, but appends to a vector in the frame arena. Use this inside process() and render() to avoid allocating
+            void getElementsByTagName(std::string tag, bool derived, Memory::FrameVector<std::shared_ptr<Element>>& output);
+
+            // Returns the first element below this one that matches a CSS style selector, or nullptr. See DOM::Selector for what's supported
+            std::shared_ptr<Element> querySelector(const std::string& selector);
+
+            // Returns every element below this one that matches a CSS style selector, in document order
+            std::vector<std::shared_ptr<Element>> querySelectorAll(const std::string& selector);
+
+            // Same as above, but appends to a vector in the frame arena
+            void querySelectorAll(const std::string& selector, Memory::FrameVector<std::shared_ptr<Element>>& output);
+
             // Finds parents of this element which are a certain tag
             std::vector<std::shared_ptr<Element>> getParentsByTagName(std::string tag, bool derived = false);
 
             // Find a vector of elements which have the class `class`. This will only look through this element's children, and their children, etc
             std::vector<std::shared_ptr<Element>> getElementsByClassName(std::string clas);
 
-            // Returns this element's children
+            // Same as above, but appends to a vector in the frame arena
+            void getElementsByClassName(std::string clas, Memory::FrameVector<std::shared_ptr<Element>>& output);
+
+            // Returns a copy of this element's children
             std::vector<std::shared_ptr<Element>> getChildren() const;
 
+            // Returns this element's children without copying them. See ChildRange
+            ChildRange getChildRange() const;
+
             // Add a child to this element. This will remove them from their previous parent
             virtual void appendChild(std::shared_ptr<Element> child);
 
-            // Function called when a new parent is added
+            // Function called when a new parent is added. Like onParentRemoved, it's called when the document delivers the frame's mutations,
+            // after process() and init(), rather than straight away. See Document::addMutationObserver
             virtual void onParentAdded() {};
 
-            // Remove a child from this element
+            // Remove a child from this element. See setKeepChildOrder for how quick it is
             virtual void removeChild(std::shared_ptr<Element> child);
 
-            // Function called when a new parent is removed
+            // If this is off, removing a child moves the last child into its place instead of shifting every child after it down.
+            // That makes removing any child constant time, but changes the order of the children. Turn it off for elements that hold lots of
+            // children whose order doesn't matter, like a pool of projectiles. On by default, where removing the last child is constant time
+            // and anything else costs about what it did before
+            void setKeepChildOrder(bool keep)
+            {
+                keep_child_order = keep;
+            }
+
+            bool getKeepChildOrder() const
+            {
+                return keep_child_order;
+            }
+
+            // Function called when this element is removed from its parent. Delivered with the frame's mutations, like onParentAdded
             virtual void onParentRemoved() {};
 
             // Checks if a given element is this element's child
@@ -223,22 +477,69 @@ namespace Engine
             // Returns true if this element has a parent
             bool hasParent();
 
-            // Returns true if the given element is a descendant of this element
+            // Returns true if the given element is a descendant of this element. Walks up from `element`, so it doesn't look through this element's children
             bool contains(std::shared_ptr<Element> element);
 
-            std::string getId();
-            void setId(std::string id);
+            // Returns true if `ancestor` is above this element
+            bool isDescendantOf(const Element* ancestor);
 
-            // This function is called the first frame after a node is added
+            const std::string& getId() const
+            {
+                return id.str();
+            }
+
+            Atom getIdAtom() const
+            {
+                return id;
+            }
+
+            void setId(const std::string& id);
+
+            // This function is called the first frame after a node is added, or later if the document's init budget has run out
             virtual void init() {};
-            bool inited = false;
+
+            // Set by whichever thread ran init(), which can be a worker if canInitAsync returns true
+            std::atomic<bool> inited {false};
+
+            // Return true if init() doesn't touch the renderer or anything else that has to be on the main thread.
+            // Those inits are run on the workers alongside each other, in no particular order
+            virtual bool canInitAsync() const
+            {
+                return false;
+            }
             
-            // The main loop. This function will be called every frame. This function will be called in it's own thread
+            // The main loop. This function will be called every frame. This function will be called in it's own thread.
+            // If this element has a process interval or rate, delta is the time since it was last called instead of the frame time
             virtual void process(float delta) {};
 
+            // Stops process() being called on this element until wake() is called. Its children carry on as normal.
+            // Sleeping elements aren't looked at at all each frame, so anything that's usually idle should sleep
+            void sleep();
+
+            // Same as above, but wakes up by itself after `seconds`
+            void sleepFor(float seconds);
+
+            void wake();
+
+            bool isSleeping() const
+            {
+                return sleeping;
+            }
+
+            // Calls process() every `frames` frames instead of every frame. 1 is every frame
+            void setProcessInterval(unsigned int frames);
+
+            // Calls process() about `hz` times a second instead of every frame. It can't be called more than once a frame,
+            // so anything faster than the frame rate is every frame. 0 goes back to every frame
+            void setProcessRate(float hz);
+
             // The _other_ main loop. This function will be called syncrinously. Mostly intended for rendering
             virtual void render(float delta) {};
 
+            // Called every frame once every process() has finished, and before any render(). Parents are always updated before their children.
+            // `parent_changed` is true if something above this element moved this frame. Return true if this element's children need to update as well
+            virtual bool propagateTransform(bool parent_changed) { return parent_changed; };
+
             // This gets called when this element is loaded from an xml file. Runs syncrinously, before init()
             // Use this to load all your data from attributes
             virtual void onLoad()
@@ -253,15 +554,12 @@ namespace Engine
 
             }
 
-            // Saves this element (and all it's children) to the specified file
-            // The produced XML can be loaded with document.loadFromFile
-            void saveToFile(std::string filename);
+            // Saves this element (and all it's children) to the specified file, as XML or the quicker to load binary format
+            // Either can be loaded with document.loadFromFile
+            void saveToFile(std::string filename, SceneFormat format = SceneFormat::xml);
 
             // Sets the visibility of this element. If it's invisible, the render function of this element and it's children will not be called
-            void setVisible(bool new_vis)
-            {
-                visible = new_vis;
-            }
+            void setVisible(bool new_vis);
 
             // Gets this element's visibility
             bool getVisible() const
@@ -270,10 +568,7 @@ namespace Engine
             }
 
             // Sets the processability of this element. If it's inprocessable, the process function of this element and it's children will not be called
-            void setProcess(bool new_proc)
-            {
-                do_process = new_proc;
-            }
+            void setProcess(bool new_proc);
 
             // Gets this element's processability
             bool getProcess() const
@@ -282,19 +577,27 @@ namespace Engine
             }
 
             // Sets one of the element's attributes
-            void setAttribute(std::string attribute, AttrVariant value);
+            void setAttribute(const std::string& attribute, AttrVariant value);
+            void setAttribute(Atom attribute, AttrVariant value);
 
-            // Gets an attribute from the element. Returns something if failed
-            AttrVariant getAttribute(std::string attribute);
+            // Gets an attribute from the element. Returns a default AttrVariant (unsigned 0) if it doesn't exist
+            AttrVariant getAttribute(const std::string& attribute) const;
+            AttrVariant getAttribute(Atom attribute) const;
 
             // Returns true is that attribute exists, otherwise false
-            bool hasAttribute(std::string attribute);
+            bool hasAttribute(const std::string& attribute) const;
+            bool hasAttribute(Atom attribute) const;
+
+            // Returns the attribute without copying it, or nullptr if it doesn't exist. The pointer is only good until the attribute is next set
+            const AttrVariant* findAttribute(Atom attribute) const;
 
-            // Destroys the element and all it's children
+            // Destroys the element and all it's children. It's taken out of its parent, and the whole subtree is unlinked in one pass
+            // and let go of at the end of the frame, so nothing is left holding on to it and deep trees don't free recursively
             void destroy();
 
             // Sets the tag name
-            void setTagName(std::string tag);
+            void setTagName(const std::string& tag);
+            void setTagName(Atom tag);
 
             // Object that stores this Element's type
             Engine::Types::TypeContainer type_container;
@@ -316,10 +619,31 @@ namespace Engine
                 return devtools_buttons;
             }
 
+            // Returns true if this element's render() has to be called on the main thread
+            bool getMainThreadRender() const
+            {
+                return main_thread_render;
+            }
+
         protected:
-            // Set this first thing
-            std::string tag_name = "element";
-            std::string id; // Id will also be an attribute, but we put it here for easy access
+            // Set this first thing, with setTagName
+            Atom tag_name;
+
+            // Set this in the constructor if render() has to run on the main thread, for example because it uses nuklear.
+            // These are rendered in tree order after everything else has been collected
+            bool main_thread_render = false;
+            Atom id; // Id will also be an attribute, but we put it here for easy access
+        };
+
+        /*
+        A change to the tree, as handed to mutation observers. Everything that happened to `node` since the last delivery is folded into one record,
+        so it was taken out of old_parent and is now in new_parent. Either can be nullptr, but not both, and they're never the same element
+        */
+        struct MutationRecord
+        {
+            std::shared_ptr<Element> node;
+            std::shared_ptr<Element> old_parent;
+            std::shared_ptr<Element> new_parent;
         };
 
         // Template black magic to get this to work
@@ -334,9 +658,10 @@ namespace Engine
         class ElementClassFactory: public ElementClass
         {
             public:
+                // Elements of each size come from their own pool, so loading and unloading scenes reuses the same memory
                 virtual std::shared_ptr<Element> getNewInstance(std::shared_ptr<Document> doc)
                 {
-                    return std::dynamic_pointer_cast<Element>(std::make_shared<T>(doc));
+                    return std::dynamic_pointer_cast<Element>(std::allocate_shared<T>(Memory::PoolAllocator<T>(), doc));
                 }
         };
     } // namespace DOM
@@ -351,6 +676,24 @@ namespace Engine
             virtual void start(std::shared_ptr<Document> doc) {};
     };
 
+    // Timings are in milliseconds. With a frame latency above 0 the process and draw phases overlap, so process is only the time spent waiting for it
+    struct TickStats
+    {
+        double process = 0;
+        double transform = 0;
+        double render = 0;
+        double draw = 0;
+        double total = 0;
+
+        // How many times process() ran this tick. Always 1 without a fixed timestep
+        int steps = 0;
+
+        // Time spent running init(), how many were run, and how many are still waiting for a later frame
+        double init = 0;
+        size_t inits = 0;
+        size_t pending_inits = 0;
+    };
+
     class Document: public std::enable_shared_from_this<Document>
     {
     private:
@@ -364,16 +707,170 @@ namespace Engine
 
         std::shared_ptr<Document> self_ptr;
 
-        void executeElement(float delta, std::shared_ptr<DOM::Element> element);
-        void renderElement(float delta, std::shared_ptr<DOM::Element> element);
+        // Elements removed from the tree this frame. Queued tasks only hold raw pointers, so these are kept alive until the end of tick
+        std::vector<std::shared_ptr<DOM::Element>> released;
+        std::mutex released_lock;
+
+        // If true, tick collects every element that needs processing into process_list first and runs them in chunks, instead of one task each
+        bool batched_process = true;
+        std::vector<DOM::Element*> process_list;
+        std::vector<float> process_deltas;
+        std::vector<DOM::Element*> render_list;
+
+        // The tree in pre-order, so a frame is a walk along these arrays instead of a recursion through every element's children.
+        // flat_subtree_end[i] is one past element i's last descendant, so skipping a subtree is one step.
+        // They're rebuilt when tree_dirty is set, and the flags are copied over again when flags_dirty is set
+        std::vector<DOM::Element*> flat_elements;
+        std::vector<glm::uint32> flat_subtree_end;
+        std::vector<glm::int32> flat_parent;
+        std::vector<glm::uint32> flat_depth;
+        std::vector<glm::uint8> flat_visible;
+        std::vector<glm::uint8> flat_process;
+
+        // Whether each element's transform changed this frame, for its children
+        std::vector<glm::uint8> flat_changed;
+
+        // Every element with an id, by id. Entries are taken out when the id changes or the element is destroyed.
+        // The raw pointer is only compared, never followed
+        struct IdEntry
+        {
+            const DOM::Element* element;
+            std::weak_ptr<DOM::Element> reference;
+        };
+        std::unordered_map<Atom, std::vector<IdEntry>> id_index;
+        std::mutex id_lock;
+
+        // Only taken by queries that read the flat tree from other threads, and by the rebuild
+        std::shared_mutex flat_lock;
+
+        // The elements of each type and class, by id. Kept up to date by setTagName, ClassList and the element destructor
+        std::vector<std::unordered_set<const DOM::Element*>> type_index;
+        std::vector<std::unordered_set<const DOM::Element*>> class_index;
+        std::mutex index_lock;
+
+        // Selectors that have been compiled, by their text
+        std::unordered_map<std::string, std::shared_ptr<DOM::Selector>> selector_cache;
+        std::mutex selector_lock;
+
+        std::atomic<bool> tree_dirty{true};
+        std::atomic<bool> flags_dirty{false};
+
+        // Rebuilds the flat arrays if anything's changed since they were last used
+        void updateFlatTree();
+        void rebuildFlatTree();
+
+        // Goes up every time updateFlatTree changes anything, so the awake list knows when it's out of date
+        glm::uint64 flat_version = 0;
+
+        /*
+        Elements that are processed every frame are kept in awake_list, which is only rebuilt when the tree, the flags or someone's schedule changes.
+        Everything else waits in a timing wheel: elements with an interval or rate, and sleeping elements with a wake up timer.
+        Slot n holds the elements due on frames that are n mod the wheel size, so a frame only looks at its own slot,
+        and elements sleeping without a timer aren't anywhere at all
+        */
+        struct WheelEntry
+        {
+            DOM::Element* element;
+            glm::uint64 frame;
+        };
+        std::vector<std::vector<WheelEntry>> schedule_wheel;
+        std::mutex schedule_lock;
+
+        std::vector<DOM::Element*> awake_list;
+        glm::uint64 awake_version = 0;
+        std::atomic<bool> schedule_dirty{true};
+
+        // 1 where an element and all of its parents can be processed, by flat index. Rebuilt with awake_list
+        std::vector<glm::uint8> flat_active;
+
+        // Frames and seconds processed so far, and the last frame's delta for guessing how many frames away a time is.
+        // With a fixed timestep every step counts as a frame
+        std::atomic<glm::uint64> frame_number{0};
+        double clock = 0;
+        float last_delta = 1.0f / 60.0f;
+
+        // Puts element in the wheel for `frame`, or takes it out. schedule_lock has to be held
+        void wheelInsert(DOM::Element* element, glm::uint64 frame);
+        void wheelRemove(DOM::Element* element);
+
+        // Works out where element goes now that its schedule has changed. schedule_lock has to be held
+        void reschedule(DOM::Element* element);
+
+        // Takes this frame's slot out of the wheel, waking anything that's due and adding elements due a process() to `due`.
+        // Their deltas go in scheduled_deltas
+        void runSchedule(std::vector<DOM::Element*>& due);
+        std::vector<DOM::Element*> scheduled_list;
+        std::vector<float> scheduled_deltas;
+
+        void rebuildAwakeList();
+
+        // How many frames the renderer runs behind process(). See setFrameLatency
+        std::atomic<int> frame_latency{1};
+
+        // With a latency of 2, the next frame's process phase is started at the end of tick and runs until sync()
+        Threading::TaskGroup ahead_group;
+        bool ahead_running = false;
+        bool processed_ahead = false;
+
+        TickStats tick_stats;
+
+        // Fixed timestep mode. Real time builds up in step_time and is spent one fixed_step at a time. See setFixedTimestep
+        float fixed_step = 0;
+        int max_steps = 5;
+        double step_time = 0;
+        float interpolation = 1;
+
+        // Works out how many process steps this tick needs, and how long each one is
+        int takeSteps(float delta, float& step_delta);
+        void processSteps(int steps, float delta);
+
+        void processPhase(float delta);
+        void transformPhase();
+        /*
+        Elements waiting for init(), in document order from init_cursor on. Only rebuilt when flat_version changes,
+        so a frame with nothing new to init doesn't walk the tree.
+        Each frame the main thread works through it until init_budget milliseconds are gone, doing at least one,
+        while the workers do every element that can init asynchronously
+        */
+        std::vector<DOM::Element*> init_queue;
+        size_t init_cursor = 0;
+        glm::uint64 init_version = 0;
+        double init_budget = 0;
+
+        void collectPendingInits();
+        void initElements();
+
+        // Tree changes since the last delivery, one per element that moved. pending_mutation_index finds an element's record so later moves fold into it
+        std::vector<DOM::MutationRecord> pending_mutations;
+        std::unordered_map<const DOM::Element*, size_t> pending_mutation_index;
+        std::mutex mutation_lock;
+
+        std::map<int, std::function<void(const std::vector<DOM::MutationRecord>&)>> mutation_observers;
+        int next_observer = 0;
+        std::mutex observer_lock;
+
+        // Calls onParentRemoved and onParentAdded for everything that's moved, then hands the records to the observers.
+        // Anything they change is delivered next tick
+        void deliverMutations();
+        void renderPhase(float delta);
+        void propagateRange(size_t begin, size_t end);
+
+        // Elements that asked to be rendered on the main thread this frame. See DOM::Element::getMainThreadRender
+        std::vector<DOM::Element*> main_thread_renders;
         std::shared_ptr<Engine::DOM::Element> xmlElementToElement(tinyxml2::XMLElement* node);
 
+        // Makes the elements in a binary scene. Returns nullptr if it can't be read
+        std::shared_ptr<Engine::DOM::Element> sceneToElement(const std::string& data);
+
     public:
         Document();
         ~Document();
 
         Types::ElementTypes element_types;
 
+        // Hands out ids for class names, the same way element_types does for tags
+        Types::ElementTypes class_types;
+
         // A map which contains the classes of each element. 
         // Mainly used when loading XML to instanciate the correct classes
         std::map<std::string, std::shared_ptr<DOM::ElementClass>> element_classes;
@@ -381,7 +878,7 @@ namespace Engine
         // Adds an element to the central database. Only added elements will be able to be loaded from files
         void addElement(std::string name, std::shared_ptr<DOM::ElementClass> type);
 
-        // Loads elements from an XML file. returns a shared pointer to the base element of the file
+        // Loads elements from an XML or binary scene file, whichever it is. returns a shared pointer to the base element of the file
         // Elements will only be properly loaded if they've beed added to the document using addElement
         std::shared_ptr<DOM::Element> loadFromFile(std::string filename);
 
@@ -401,10 +898,160 @@ namespace Engine
 
         void tick(float delta);
 
+        /*
+        Sets how far rendering trails behind the elements:
+        0 - process, then draw what was just rendered. Nothing overlaps
+        1 - the renderer draws last frame's queue on the main thread while the workers run process() for this frame (the default)
+        2 - as 1, but tick also starts the next frame's process() before it returns, so it runs while the renderer presents the frame.
+            Elements must not be touched between ticks until sync() has been called, and process() sees input from a frame earlier
+        Anything outside 0 to 2 is clamped
+        */
+        void setFrameLatency(int latency);
+
+        int getFrameLatency() const
+        {
+            return frame_latency;
+        }
+
+        // Waits for anything tick left running. Renderers call this before they change the input state or finish
+        void sync();
+
+        // How long the main thread spent in each phase of the last tick
+        TickStats getTickStats() const
+        {
+            return tick_stats;
+        }
+
+        /*
+        Runs process() in fixed steps of `seconds` instead of once per tick with the frame's delta. Each tick runs however many steps
+        the time since the last one adds up to, then renders. The time left over is given by getInterpolation(), and Element3Ds use it
+        to draw themselves between where they were before the last step and where they are now.
+        Transforms are propagated once per tick, after all of its steps. 0 (the default) goes back to one process() per tick
+        */
+        void setFixedTimestep(float seconds);
+
+        float getFixedTimestep() const
+        {
+            return fixed_step;
+        }
+
+        // The most steps one tick will run. If a tick falls further behind than that, the extra time is dropped rather than
+        // making the next tick even longer. Defaults to 5
+        void setMaxSteps(int steps);
+
+        int getMaxSteps() const
+        {
+            return max_steps;
+        }
+
+        // How far between the last two steps the current render is, from 0 to 1. Always 1 without a fixed timestep
+        float getInterpolation() const
+        {
+            return interpolation;
+        }
+
+        // How many process steps have run. Goes up by one each step, so an element can tell whether it's already done something this step
+        glm::uint64 getFrameNumber() const
+        {
+            return frame_number;
+        }
+
+        // Sets how many milliseconds a frame can spend on init() on the main thread. Whatever's left over is inited over the next frames,
+        // and isn't rendered until then. 0 (the default) inits everything the frame it's added
+        void setInitBudget(double milliseconds)
+        {
+            init_budget = milliseconds;
+        }
+
+        double getInitBudget() const
+        {
+            return init_budget;
+        }
+
+        // Switches between running process() in chunks over a flat list of elements (the default) and queueing a task for every element
+        void setBatchedProcess(bool batched)
+        {
+            batched_process = batched;
+        }
+
+        bool getBatchedProcess() const
+        {
+            return batched_process;
+        }
+
+        // Elements call these when they're added or removed, or when they're shown, hidden, paused or unpaused. The flat tree is brought up to date before it's next walked
+        void markTreeDirty()
+        {
+            tree_dirty = true;
+        }
+
+        void markFlagsDirty()
+        {
+            flags_dirty = true;
+        }
+
+        // Element::sleep, wake and setProcessInterval go through these, so the wheel is only changed with its lock held.
+        // wake_seconds below 0 means there's no timer. period is in seconds, and 0 means use interval
+        void setSleeping(DOM::Element* element, bool sleep, float wake_seconds);
+        void setProcessSchedule(DOM::Element* element, unsigned int interval, float period);
+
+        // Takes an element out of the timing wheel. The element destructor calls this
+        void unschedule(DOM::Element* element);
+
+        // Finds an element with the given id anywhere in the document
+        std::shared_ptr<DOM::Element> getElementById(const std::string& id)
+        {
+            return findElementById(id, base.get());
+        }
+
+        // Finds an element with the given id below `scope`. If more than one has it, the first one in the tree is returned
+        std::shared_ptr<DOM::Element> findElementById(const std::string& id, DOM::Element* scope);
+        std::shared_ptr<DOM::Element> findElementById(Atom id, DOM::Element* scope);
+
+        // Appends every element with the given id below `scope`, in no particular order
+        void findElementsById(const std::string& id, DOM::Element* scope, Memory::FrameVector<std::shared_ptr<DOM::Element>>& output);
+        void findElementsById(Atom id, DOM::Element* scope, Memory::FrameVector<std::shared_ptr<DOM::Element>>& output);
+
+        // Compiles a selector, or returns the one compiled last time the same text was used
+        std::shared_ptr<DOM::Selector> getSelector(const std::string& text);
+
+        // Elements and class lists keep the type and class indexes up to date with these
+        void addToIndex(bool by_class, int id, const DOM::Element* element);
+        void removeFromIndex(bool by_class, int id, const DOM::Element* element);
+
+        // How many elements have the type (or class)
+        size_t getIndexedCount(bool by_class, int id);
+
+        // Puts the elements below `scope` that have the type (or class) into output, in document order.
+        // Returns false if the tree has changed since it was last flattened, since then the index can't tell where anything is
+        bool findIndexed(bool by_class, int id, DOM::Element* scope, Memory::FrameVector<DOM::Element*>& output);
+
+        // Element::setId keeps the id index up to date with these
+        void indexId(Atom id, const std::shared_ptr<DOM::Element>& element);
+        void unindexId(Atom id, const DOM::Element* element);
+
+        // appendChild and removeChild call this when `node` moves. new_parent is nullptr if it was removed
+        void recordMutation(const std::shared_ptr<DOM::Element>& node, const std::shared_ptr<DOM::Element>& old_parent, const std::shared_ptr<DOM::Element>& new_parent);
+
+        /*
+        Calls `callback` once a tick with every element that's been added, removed or moved since the last time, if there were any.
+        They're delivered after process() and init() have run, and before transforms are propagated. An element added and removed again in between
+        isn't reported at all. Returns an id for removeMutationObserver
+        */
+        int addMutationObserver(std::function<void(const std::vector<DOM::MutationRecord>&)> callback);
+        void removeMutationObserver(int observer);
+
+        // Keeps an element alive until the end of the current frame. removeChild calls this
+        void deferRelease(std::shared_ptr<DOM::Element> element);
+
+        // Same as above, for a whole batch at once. Element::destroy calls this
+        void deferRelease(std::vector<std::shared_ptr<DOM::Element>>& elements);
+
         void destroy();
 
-        static std::shared_ptr<Document> createDocument() {
-            Engine::Threading::startThreads();
+        // Creates a document and starts the thread pool. Pass settings to turn threading off or change how many threads are used
+        static std::shared_ptr<Document> createDocument(Threading::Settings threading = Threading::Settings()) {
+            Engine::Threading::startThreads(threading);
             auto document = std::make_shared<Engine::Document>();
             document->setup();
             return document;
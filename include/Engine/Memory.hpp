@@ -0,0 +1,288 @@
+#ifndef ENGINE_MEMORY_H
+#define ENGINE_MEMORY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace Engine
+{
+    namespace Memory
+    {
+        /*
+        A bump allocator. Memory is handed out from big blocks, freeing does nothing, and reset() takes everything back at once.
+        The blocks are kept between resets, so once it's grown big enough it stops allocating altogether.
+        Only one thread may use an arena at a time
+        */
+        class LinearArena
+        {
+            private:
+                struct Block
+                {
+                    char* data;
+                    size_t size;
+                };
+
+                std::vector<Block> blocks;
+                size_t current;
+                size_t offset;
+                size_t block_size;
+
+                // Bytes handed out since the last reset, and the most there has ever been
+                size_t used;
+                size_t peak;
+
+            public:
+                LinearArena(size_t block_size = 64 * 1024);
+                ~LinearArena();
+
+                LinearArena(const LinearArena&) = delete;
+                LinearArena& operator=(const LinearArena&) = delete;
+
+                void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+                // Takes back everything this arena has handed out. Anything still using that memory is now broken
+                void reset();
+
+                size_t getUsed() const
+                {
+                    return used;
+                }
+
+                size_t getPeak() const
+                {
+                    return peak;
+                }
+
+                // Memory held by this arena, used or not
+                size_t getReserved() const;
+        };
+
+        /*
+        Gives the calling thread a frame arena, which resetFrameArenas rewinds at the end of every frame.
+        Threading::startThreads calls this for the main thread and every worker. Only call it on a thread that can't be running while Document::tick finishes
+        */
+        void registerFrameThread();
+
+        // True if the calling thread has a frame arena
+        bool hasFrameArena();
+
+        /*
+        The arena for the calling thread. The main thread and every worker get their own, and they're all reset at the end of Document::tick.
+        Anything allocated from it must not be used after the frame it was allocated in.
+        Any other thread (like the lesser thread) gets an arena that's never reset for it, since it might be in the middle of using it. It has to reset it itself
+        */
+        LinearArena& getFrameArena();
+
+        // Resets every thread's frame arena. Document::tick calls this once every task has finished, you shouldn't need to
+        void resetFrameArenas();
+
+        struct FrameStats
+        {
+            // Bytes allocated from the frame arenas last frame, by every thread put together
+            size_t bytes_used = 0;
+
+            // The most any frame has used
+            size_t peak_bytes = 0;
+
+            // Memory held by the frame arenas
+            size_t bytes_reserved = 0;
+
+            // Number of frame arenas. Threads that have finished give theirs to the next one that registers
+            int arenas = 0;
+        };
+
+        FrameStats getFrameStats();
+
+        /*
+        An STL allocator that allocates from the frame arena of whichever thread is allocating. Deallocating does nothing, the memory goes back at the end of the frame.
+        Containers using it (see FrameVector and FrameString) can be passed between the main thread and the workers, but must be gone by the end of the frame.
+        Containers made on a thread without a frame arena use the heap instead, so they can live as long as they like. They mustn't be grown on a frame thread, or the other way around
+        */
+        template<typename T>
+        class FrameAllocator
+        {
+            private:
+                template<typename U>
+                friend class FrameAllocator;
+
+                bool heap;
+
+            public:
+                typedef T value_type;
+
+                // The allocator has to go wherever the memory does, since heap memory has to be freed by one that knows it's from the heap
+                typedef std::true_type propagate_on_container_copy_assignment;
+                typedef std::true_type propagate_on_container_move_assignment;
+                typedef std::true_type propagate_on_container_swap;
+
+                FrameAllocator() noexcept: heap(!hasFrameArena()) {};
+
+                template<typename U>
+                FrameAllocator(const FrameAllocator<U>& other) noexcept: heap(other.heap) {};
+
+                // A copy belongs to the thread making it
+                FrameAllocator select_on_container_copy_construction() const
+                {
+                    return FrameAllocator();
+                }
+
+                T* allocate(size_t n)
+                {
+                    if (n > std::numeric_limits<size_t>::max() / sizeof(T))
+                    {
+                        throw std::bad_alloc();
+                    }
+                    if (heap)
+                    {
+                        return static_cast<T*>(::operator new(n * sizeof(T)));
+                    }
+                    return static_cast<T*>(getFrameArena().allocate(n * sizeof(T), alignof(T)));
+                }
+
+                void deallocate(T* pointer, size_t) noexcept
+                {
+                    if (heap)
+                    {
+                        ::operator delete(pointer);
+                    }
+                };
+
+                template<typename U>
+                bool operator==(const FrameAllocator<U>& other) const noexcept
+                {
+                    return heap == other.heap;
+                }
+
+                template<typename U>
+                bool operator!=(const FrameAllocator<U>& other) const noexcept
+                {
+                    return heap != other.heap;
+                }
+        };
+
+        template<typename T>
+        using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+        typedef std::basic_string<char, std::char_traits<char>, FrameAllocator<char>> FrameString;
+
+        /*
+        Hands out blocks that are all the same size. Freed blocks go on a free list and are handed out again before any new memory is allocated,
+        so making and destroying the same kind of object over and over settles into reusing the same memory.
+        Memory is taken from the system in chunks and never given back. Any thread may use a pool
+        */
+        class ObjectPool
+        {
+            private:
+                struct FreeBlock
+                {
+                    FreeBlock* next;
+                };
+
+                std::vector<char*> chunks;
+                FreeBlock* free_list;
+                size_t block_size;
+                size_t alignment;
+                size_t blocks_per_chunk;
+
+                size_t used;
+                size_t peak;
+
+                std::mutex lock;
+
+            public:
+                ObjectPool(size_t block_size, size_t alignment, size_t blocks_per_chunk = 64);
+                ~ObjectPool();
+
+                ObjectPool(const ObjectPool&) = delete;
+                ObjectPool& operator=(const ObjectPool&) = delete;
+
+                void* allocate();
+                void deallocate(void* block);
+
+                size_t getBlockSize() const
+                {
+                    return block_size;
+                }
+
+                // Blocks handed out and not given back yet, and the most there have ever been
+                size_t getUsed();
+                size_t getPeak();
+
+                // Memory held by this pool, used or not
+                size_t getReserved();
+        };
+
+        // Returns the pool for objects of size and alignment, so types that are the same size share one. Pools are made the first time they're asked for and are never freed
+        ObjectPool& getPool(size_t size, size_t alignment);
+
+        struct PoolStats
+        {
+            // Bytes in blocks that are handed out, across every pool
+            size_t bytes_used = 0;
+
+            // Memory held by every pool
+            size_t bytes_reserved = 0;
+
+            int pools = 0;
+        };
+
+        PoolStats getPoolStats();
+
+        /*
+        An STL allocator that takes single objects from the pool for their size. Use it with std::allocate_shared so the object and its reference counts come from one block.
+        Anything asking for more than one object at a time gets normal memory
+        */
+        template<typename T>
+        class PoolAllocator
+        {
+            public:
+                typedef T value_type;
+
+                PoolAllocator() noexcept {};
+
+                template<typename U>
+                PoolAllocator(const PoolAllocator<U>&) noexcept {};
+
+                T* allocate(size_t n)
+                {
+                    if (n != 1)
+                    {
+                        return std::allocator<T>().allocate(n);
+                    }
+                    static ObjectPool& pool = getPool(sizeof(T), alignof(T));
+                    return static_cast<T*>(pool.allocate());
+                }
+
+                void deallocate(T* pointer, size_t n) noexcept
+                {
+                    if (n != 1)
+                    {
+                        std::allocator<T>().deallocate(pointer, n);
+                        return;
+                    }
+                    static ObjectPool& pool = getPool(sizeof(T), alignof(T));
+                    pool.deallocate(pointer);
+                }
+
+                template<typename U>
+                bool operator==(const PoolAllocator<U>&) const noexcept
+                {
+                    return true;
+                }
+
+                template<typename U>
+                bool operator!=(const PoolAllocator<U>&) const noexcept
+                {
+                    return false;
+                }
+        };
+    }
+}
+
+#endif
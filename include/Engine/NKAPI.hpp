@@ -21,6 +21,9 @@ namespace Engine
                 NuklearElement(std::shared_ptr<Document> document): DOM::Element(document)
                 {
                     setTagName("nuklear");
+
+                    // Nuklear isn't thread safe
+                    main_thread_render = true;
                 }
                 virtual void render(float delta);
         };
@@ -12,6 +12,7 @@
 #include <mutex>
 #include <string>
 #include "glm/fwd.hpp"
+#include <atomic>
 #include <glm/glm.hpp>
 #include <vector>
 
@@ -29,7 +30,7 @@ namespace Engine {
                 glm::uint32 handle;
                 void checkCompileErrors(glm::uint32 shader, AmberShaderType type);
 
-                GLint getUniformLocation(const std::string name);
+                GLint getUniformLocation(const std::string& name);
 
                 std::map<std::string, GLint> uniform_locations;
 
@@ -41,14 +42,14 @@ namespace Engine {
 
                 virtual void destroy();
 
-                virtual void setUniform(const std::string label, const float& value);
-                virtual void setUniform(const std::string label, const int& value);
-                virtual void setUniform(const std::string label, const bool& value);
+                virtual void setUniform(const std::string& label, const float& value);
+                virtual void setUniform(const std::string& label, const int& value);
+                virtual void setUniform(const std::string& label, const bool& value);
 
-                virtual void setUniform(const std::string label, const glm::vec2& value);
-                virtual void setUniform(const std::string label, const glm::vec3& value);
-                virtual void setUniform(const std::string label, const glm::vec4& value);
-                virtual void setUniform(const std::string label, const glm::mat4& value);
+                virtual void setUniform(const std::string& label, const glm::vec2& value);
+                virtual void setUniform(const std::string& label, const glm::vec3& value);
+                virtual void setUniform(const std::string& label, const glm::vec4& value);
+                virtual void setUniform(const std::string& label, const glm::mat4& value);
         };
 
         class AmberRenderObject: public RenderObject
@@ -92,8 +93,12 @@ namespace Engine {
                 std::vector<std::shared_ptr<AmberShaderProgram>> shaders;
                 std::vector<std::shared_ptr<AmberRenderObject>> objects;
 
+                // process() can change the camera, so it's only read in finishQueue. drawFrame uses the view matrix taken then
+                std::mutex camera_lock;
                 bool has_camera = false;
                 std::shared_ptr<ICamera> camera;
+                bool current_has_camera = false;
+                glm::mat4 current_view;
 
                 std::function<void(float)> render_func;
 
@@ -101,15 +106,26 @@ namespace Engine {
                 glm::vec2 offset;
                 glm::vec2 old_position;
 
+                // process() runs on the workers, but GLFW only lets the main thread ask about input or change the cursor.
+                // So loop() takes a copy of the input after polling events, and mode changes wait for loop() to apply them
+                bool key_state[GLFW_KEY_LAST + 1];
+                bool button_state[GLFW_MOUSE_BUTTON_LAST + 1];
+                float scroll_offset;
+                std::atomic<Engine::Input::MouseMode> requested_mouse_mode;
+                std::atomic<Engine::Input::CursorMode> requested_cursor_mode;
+                Engine::Input::CursorMode cursor_mode;
+
+                void pollInput();
+
                 std::mutex next_lock;
                 std::vector<PipeItem> current_frame;
                 std::vector<PipeItem> next_frame;
 
                 std::mutex next_light_lock;
-                std::vector<std::shared_ptr<E3D::LightElement3D>> current_light_frame;
-                std::vector<std::shared_ptr<E3D::LightElement3D>> next_light_frame;
+                std::vector<LightData> current_light_frame;
+                std::vector<LightData> next_light_frame;
 
-                void renderPipeItem(PipeItem p);
+                void renderPipeItem(const PipeItem& p);
 
             public:
                 Amber(std::shared_ptr<Document> doc);
@@ -131,6 +147,7 @@ namespace Engine {
 
                 virtual void addToRenderQueue(std::shared_ptr<RenderObject> obj, std::shared_ptr<UniformObject> uobj, glm::mat4 globa, glm::mat4 local, CullingMode cm= CullingMode::Both);
                 virtual void drawFrame(float delta);
+                virtual void finishQueue();
 
                 // Adds a light to the scene. Lights will be passed into the material manager
                 virtual void addLight(std::shared_ptr<E3D::LightElement3D> light);
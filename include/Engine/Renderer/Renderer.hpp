@@ -46,14 +46,14 @@ namespace Engine {
                 virtual void destroy() {};
                 virtual void use() {};
 
-                virtual void setUniform(const std::string label, const float& value) {};
-                virtual void setUniform(const std::string label, const int& value) {};
-                virtual void setUniform(const std::string label, const bool& value) {};
-
-                virtual void setUniform(const std::string label, const glm::vec2& value) {};
-                virtual void setUniform(const std::string label, const glm::vec3& value) {};
-                virtual void setUniform(const std::string label, const glm::vec4& value) {};
-                virtual void setUniform(const std::string label, const glm::mat4& value) {};
+                virtual void setUniform(const std::string& label, const float& value) {};
+                virtual void setUniform(const std::string& label, const int& value) {};
+                virtual void setUniform(const std::string& label, const bool& value) {};
+
+                virtual void setUniform(const std::string& label, const glm::vec2& value) {};
+                virtual void setUniform(const std::string& label, const glm::vec3& value) {};
+                virtual void setUniform(const std::string& label, const glm::vec4& value) {};
+                virtual void setUniform(const std::string& label, const glm::mat4& value) {};
         };
 
         class RenderObject
@@ -119,13 +119,22 @@ namespace Engine {
                 virtual void checkInited() {};
         };
 
+        // A light as it was when the frame was collected. The frame is drawn with these, so it doesn't matter if the light moves while that happens
+        struct LightData
+        {
+            glm::vec4 position;
+            glm::vec3 ambient;
+            glm::vec3 intensity;
+            int radius;
+        };
+
         // This class kinda represents a material
         // When an object is rendered, it is called to set the appropriate uniforms
         // On the ShaderProgram
         class UniformObject
         {
             public:
-                virtual void setUniforms(std::shared_ptr<ShaderProgram> prog, std::shared_ptr<RenderObject> re, std::vector<std::shared_ptr<E3D::LightElement3D>> lights, glm::mat4 global_position) {};
+                virtual void setUniforms(std::shared_ptr<ShaderProgram> prog, std::shared_ptr<RenderObject> re, const std::vector<LightData>& lights, glm::mat4 global_position) {};
         };
 
         class ICamera
@@ -151,12 +160,15 @@ namespace Engine {
                 virtual std::shared_ptr<ShaderProgram> addShaderProgram(std::shared_ptr<ShaderResource> vert, std::shared_ptr<ShaderResource> frag) {return nullptr;};
                 
                 virtual void drawFrame(float delta) {};
+
+                // Called by the document once everything has been added to the render queue. What was queued becomes what drawFrame draws
+                virtual void finishQueue() {};
                 // virtual void addToRenderQueue(RenderObject obj, UniformObject uobj, glm::mat4 globa, glm::mat4 local) {};
 
                 virtual std::shared_ptr<RenderObject> addRenderObject() {return nullptr;};
                 virtual void addToRenderQueue(std::shared_ptr<RenderObject> obj, std::shared_ptr<UniformObject> uobj, glm::mat4 globa, glm::mat4 local, CullingMode cm= CullingMode::Both) {};
 
-                // Adds a light to the scene. Lights will be passed into the material manager
+                // Adds a light to the scene. Lights will be passed into the material manager. Where the light is and its settings are copied straight away
                 virtual void addLight(std::shared_ptr<E3D::LightElement3D> light) {};
 
                 virtual void cleanup() {};
@@ -164,6 +176,8 @@ namespace Engine {
                 virtual void setCamera(std::shared_ptr<ICamera> cam) {};
                 virtual std::shared_ptr<ICamera> getCamera() {return nullptr;};
 
+                // Input is read once per frame, before the document ticks, so these are safe to call from process() on any thread.
+                // Changing the mouse or cursor mode takes effect at the start of the next frame
                 virtual bool isKeyPressed(int key) {return false;};
                 virtual bool isMouseButtonPressed(int button) {return false;};
 
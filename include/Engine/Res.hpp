@@ -154,7 +154,13 @@ namespace Engine {
 
                     LOG_INFO("Saving file: " + getDirname() + "/" + filename);
 
-                    std::ofstream file (getDirname() + "/" + filename, std::ios::out);
+                    std::ios::openmode mode = std::ios::out;
+                    if (file_type == FileType::binary)
+                    {
+                        mode |= std::ios::binary;
+                    }
+
+                    std::ofstream file (getDirname() + "/" + filename, mode);
                     if (!file.is_open())
                     {
                         LOG_ERROR("Could not open file: " + filename);
@@ -0,0 +1,140 @@
+#ifndef ENGINE_SCENE_H
+#define ENGINE_SCENE_H
+
+#include "Engine/Engine.hpp"
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Engine
+{
+    namespace Scene
+    {
+        /*
+        The binary scene format. It holds the same things as an XML scene, but nothing in it has to be parsed:
+        names are only stored once, attributes keep their type, and matrices are raw floats.
+        Everything is in native byte order, like the other binary files the engine writes:
+            "ESCN", uint16 version
+            uint32 string count, then each string as a uint32 length and its bytes. Every name and string value below is an index into these
+            uint32 element count, then every element in document order:
+                uint32 tag, uint32 child count, uint32 id (no_string if it hasn't got one)
+                uint32 class count, then a uint32 for each class
+                uint32 attribute count, then for each a uint32 name, a uint8 AttrType, and the value:
+                    a uint32 for unsigned and string (an index), an int32, a float, or 16 floats for a mat4, column by column
+        Each element's children come straight after it, and their children straight after each of them.
+        Version 1 was the same, except the class and attribute counts were uint16. Those files can still be read
+        */
+        const char magic[4] = {'E', 'S', 'C', 'N'};
+        const glm::uint16 format_version = 2;
+        const glm::uint32 no_string = 0xFFFFFFFF;
+
+        // The order of DOM::AttrVariant's types
+        enum AttrType: glm::uint8 { unsigned_attr, int_attr, float_attr, string_attr, matrix_attr };
+
+        // Returns true if data starts with the binary scene magic bytes
+        bool isBinaryScene(const std::string& data);
+
+        // Works out what type an attribute from an XML file is: a number if it looks like one, a mat4 if it's 16 of them, otherwise a string
+        DOM::AttrVariant parseAttribute(const std::string& text);
+
+        // Sets an attribute on an XML element, writing matrices as 16 numbers
+        void setXMLAttribute(tinyxml2::XMLElement* node, const std::string& name, const DOM::AttrVariant& value);
+
+        // Builds up a binary scene one element at a time, in document order
+        class Writer
+        {
+            private:
+                std::string elements;
+                glm::uint32 element_count = 0;
+
+                std::vector<const std::string*> strings;
+                std::unordered_map<std::string, glm::uint32> string_index;
+
+                glm::uint32 addString(const std::string& text);
+
+                template<typename T>
+                void write(T value)
+                {
+                    elements.append(reinterpret_cast<const char*>(&value), sizeof(T));
+                }
+
+            public:
+                // Adds an element. The next child_count elements added are its children, each followed by its own children
+                void addElement(const std::string& tag, glm::uint32 child_count, const std::string& id, const std::vector<std::string>& classes,
+                                const std::vector<std::pair<std::string, DOM::AttrVariant>>& attributes);
+
+                // Returns the finished file
+                std::string finish();
+        };
+
+        // One element read from a binary scene. Names are indexes into the reader's strings
+        struct ElementRecord
+        {
+            glm::uint32 tag;
+            glm::uint32 child_count;
+            glm::uint32 id;
+            std::vector<glm::uint32> classes;
+            std::vector<std::pair<glm::uint32, DOM::AttrVariant>> attributes;
+        };
+
+        // Reads a binary scene. The data has to outlive the reader
+        class Reader
+        {
+            private:
+                const std::string& data;
+                size_t offset = 0;
+                bool valid = false;
+                glm::uint16 version = 0;
+
+                std::vector<std::string> strings;
+                glm::uint32 element_count = 0;
+
+                template<typename T>
+                bool read(T& value)
+                {
+                    if (offset + sizeof(T) > data.size())
+                    {
+                        return false;
+                    }
+                    std::memcpy(&value, data.data() + offset, sizeof(T));
+                    offset += sizeof(T);
+                    return true;
+                }
+
+                bool readString(glm::uint32& index);
+
+                // Reads a class or attribute count, which can't be more than there's room left for if each entry takes at least entry_size bytes
+                bool readCount(glm::uint32& count, size_t entry_size);
+
+            public:
+                // Reads the header and the string table. Logs an error and leaves the reader invalid if they're not right
+                Reader(const std::string& data);
+
+                bool isValid() const
+                {
+                    return valid;
+                }
+
+                glm::uint32 getElementCount() const
+                {
+                    return element_count;
+                }
+
+                const std::vector<std::string>& getStrings() const
+                {
+                    return strings;
+                }
+
+                // Reads the next element. Returns false if the file is cut short or refers to something that isn't there
+                bool readElement(ElementRecord& output);
+        };
+
+        // Converts between the two formats without making any elements, so nothing's loaded and no renderer is needed.
+        // Attributes get the types loading the XML would give them. Both return false and log an error if the input can't be read
+        bool xmlToBinary(const std::string& xml, std::string& output);
+        bool binaryToXML(const std::string& data, std::string& output);
+    }
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef ENGINE_SELECTOR_H
+#define ENGINE_SELECTOR_H
+
+#include "Engine/Engine.hpp"
+#include <string>
+#include <vector>
+
+namespace Engine
+{
+    namespace DOM
+    {
+        /*
+        A CSS style selector, parsed once so it can be matched over and over. Get these from Document::getSelector, which caches them.
+        Supports:
+            tag             elements with exactly that tag
+            :type(tag)      elements with that tag, or one derived from it
+            *               anything
+            #id             elements with that id
+            .class          elements with that class
+            [attr]          elements that have that attribute
+            [attr=value]    elements where that attribute equals value. The value can be quoted
+        Put several of these together with no spaces to need all of them, like mesh3d.enemy.
+        Separate them with spaces to match a descendant, or with > to match a direct child, like mesh3d.enemy > light3d
+        */
+        class Selector
+        {
+            private:
+                struct Attribute
+                {
+                    Atom name;
+                    bool has_value;
+                    std::string value;
+                };
+
+                // One part of the selector, between combinators
+                struct Compound
+                {
+                    // Empty if any tag will do
+                    Atom tag;
+                    bool derived = false;
+
+                    // The type id of tag, for the index
+                    int type = 0;
+
+                    Atom id;
+
+                    std::vector<Atom> classes;
+                    std::vector<int> class_ids;
+
+                    std::vector<Attribute> attributes;
+
+                    // True if this has to be a direct child of what the compound before it matched, rather than any descendant
+                    bool child = false;
+                };
+
+                std::vector<Compound> compounds;
+                bool valid;
+
+                bool parse(const std::string& text, Document* document);
+                bool matchesCompound(Element* element, const Compound& compound) const;
+
+                // Checks compounds before `index` against element's ancestors. The compound at `index` has already matched element
+                bool matchesAncestors(Element* element, size_t index) const;
+
+                // Appends the elements below scope that match compounds up to and including `last`, using the index for that compound where it can
+                void collect(Element* scope, size_t last, Memory::FrameVector<Element*>& output, bool first_only) const;
+
+                // Roughly how many elements could match a compound on its own
+                size_t estimate(Document* document, const Compound& compound) const;
+
+            public:
+                Selector(const std::string& text, Document* document);
+
+                // False if the text couldn't be parsed. An invalid selector matches nothing
+                bool isValid() const
+                {
+                    return valid;
+                }
+
+                // Returns true if element matches the selector
+                bool matches(Element* element) const;
+
+                // Appends the elements below scope that match, in document order. Stops after the first one if first_only is set
+                void query(Element* scope, Memory::FrameVector<Element*>& output, bool first_only) const;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,392 @@
+#ifndef ENGINE_THREADING_H
+#define ENGINE_THREADING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Engine
+{
+    namespace Threading
+    {
+        // Counts a task that was too big to store inline. Used by Task, see getTaskStats
+        void _countHeapTask();
+
+        /*
+        A move-only callable, kind of like a std::function that can't be copied.
+        Anything up to inline_size bytes is stored inside the Task itself, so queueing a lambda that captures a few pointers never touches the heap
+        */
+        class Task
+        {
+            public:
+                static constexpr size_t inline_size = 48;
+
+            private:
+                enum Operation {Move, Destroy};
+
+                alignas(std::max_align_t) unsigned char storage[inline_size];
+                void (*invoker)(void* storage);
+                void (*manager)(Operation op, void* storage, void* other);
+
+            public:
+                Task() noexcept: invoker(nullptr), manager(nullptr) {};
+
+                template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Task>::value>::type>
+                Task(F&& function)
+                {
+                    typedef typename std::decay<F>::type Functor;
+
+                    if constexpr (sizeof(Functor) <= inline_size && alignof(Functor) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible<Functor>::value)
+                    {
+                        new (storage) Functor(std::forward<F>(function));
+                        invoker = [](void* s) {
+                            (*reinterpret_cast<Functor*>(s))();
+                        };
+                        manager = [](Operation op, void* s, void* other) {
+                            Functor* f = reinterpret_cast<Functor*>(s);
+                            if (op == Operation::Move)
+                            {
+                                new (other) Functor(std::move(*f));
+                            }
+                            f->~Functor();
+                        };
+                    }
+                    else
+                    {
+                        // Too big, so it has to go on the heap
+                        Functor* f = new Functor(std::forward<F>(function));
+                        std::memcpy(storage, &f, sizeof(f));
+                        _countHeapTask();
+
+                        invoker = [](void* s) {
+                            (**reinterpret_cast<Functor**>(s))();
+                        };
+                        manager = [](Operation op, void* s, void* other) {
+                            if (op == Operation::Move)
+                            {
+                                std::memcpy(other, s, sizeof(Functor*));
+                            }
+                            else
+                            {
+                                delete *reinterpret_cast<Functor**>(s);
+                            }
+                        };
+                    }
+                }
+
+                Task(Task&& other) noexcept: invoker(other.invoker), manager(other.manager)
+                {
+                    if (manager != nullptr)
+                    {
+                        manager(Operation::Move, other.storage, storage);
+                    }
+                    other.invoker = nullptr;
+                    other.manager = nullptr;
+                }
+
+                Task& operator=(Task&& other) noexcept
+                {
+                    if (this != &other)
+                    {
+                        this->~Task();
+                        new (this) Task(std::move(other));
+                    }
+                    return *this;
+                }
+
+                Task(const Task&) = delete;
+                Task& operator=(const Task&) = delete;
+
+                ~Task()
+                {
+                    if (manager != nullptr)
+                    {
+                        manager(Operation::Destroy, storage, nullptr);
+                        manager = nullptr;
+                        invoker = nullptr;
+                    }
+                }
+
+                void operator()()
+                {
+                    invoker(storage);
+                }
+
+                explicit operator bool() const
+                {
+                    return invoker != nullptr;
+                }
+        };
+
+        enum Priority
+        {
+            // Picked up before anything else. Use this for work the rest of the frame is waiting on
+            Critical = 0,
+
+            // Everything else in the frame. Document::tick uses this
+            Normal = 1,
+
+            // Runs on the lesser thread only, and isn't waited for by waitForCompletion, so it can take as many frames as it likes.
+            // Use this for things like decompressing assets or saving
+            Background = 2
+        };
+
+        enum Mode
+        {
+            // No pool at all. Every task runs straight away on the thread that added it
+            Off,
+
+            // Exactly Settings::threads threads
+            Fixed,
+
+            // One thread per core, minus Settings::reserved
+            Auto
+        };
+
+        struct Settings
+        {
+            Mode mode = Mode::Auto;
+
+            // Used by Fixed. This counts the lesser thread, but not the thread calling startThreads
+            int threads = 4;
+
+            // Used by Auto. Cores to leave alone, for example for the game's own threads
+            int reserved = 0;
+        };
+
+        // Starts the thread pool. Document::createDocument calls this for you.
+        // Builds without thread support (like emscripten) always behave as if the mode was Off
+        void startThreads(Settings settings = Settings());
+
+        // The settings the pool was started with
+        Settings getSettings();
+
+        void threadWorker(int index);
+        void lesserThreadWorker();
+        void cleanup();
+
+        // Waits until every Critical and Normal task has finished. The calling thread helps out while it waits
+        void waitForCompletion();
+
+        void addTask(Task task, Priority priority = Priority::Normal);
+
+        // Same as addTask(task, Priority::Background)
+        void addLesserTask(Task task);
+
+        // Waits until every Background task has finished. Mostly useful before shutting down
+        void waitForBackground();
+
+        // Number of tasks of the given priority that are queued but haven't started yet
+        int getQueueDepth(Priority priority);
+
+        // Number of Background tasks that haven't finished yet, including ones that are running
+        int getPendingBackgroundTasks();
+
+        // Waits until `done` returns true. Like waitForCompletion, the calling thread runs tasks while it waits
+        void waitUntil(std::function<bool()> done);
+
+        // Wakes up anything sitting in waitUntil so it checks its condition again
+        void notifyWaiters();
+
+        /*
+        A set of tasks that can be waited on together, without waiting on everything else in the pool.
+        Document::tick uses one of these for each phase of the frame
+        */
+        class TaskGroup
+        {
+            private:
+                std::atomic<int> pending;
+
+            public:
+                TaskGroup(): pending(0) {};
+                ~TaskGroup();
+
+                // Queues a task as part of this group
+                void addTask(Task task, Priority priority = Priority::Normal);
+
+                // Waits until every task in this group (including tasks added by those tasks) has finished
+                void wait();
+
+                bool isDone() const
+                {
+                    return pending.load() == 0;
+                }
+
+                // Used by Job, you shouldn't need to call these yourself
+                void _begin();
+                void _end();
+        };
+
+        // Number of threads that run frame tasks, including the one that called startThreads. 1 when threading is off
+        int getThreadCount();
+
+        /*
+        Calls function(i) for every i from begin up to (but not including) end, spread over the pool.
+        The range is cut into a few chunks per thread rather than queueing every item. `grain` is the smallest chunk worth its own task, 0 lets it decide.
+        The calling thread runs a chunk as well, and this only returns once every call has finished
+        */
+        template<typename F>
+        void parallelFor(size_t begin, size_t end, F&& function, size_t grain = 0, Priority priority = Priority::Normal)
+        {
+            if (end <= begin)
+            {
+                return;
+            }
+
+            size_t count = end - begin;
+            size_t threads = (size_t)getThreadCount();
+
+            // A few chunks per thread, so one that finishes early can steal from the others
+            size_t chunk = count / (threads * 4);
+            if (chunk < grain)
+            {
+                chunk = grain;
+            }
+            if (chunk == 0)
+            {
+                chunk = 1;
+            }
+
+            if (threads <= 1 || chunk >= count)
+            {
+                // Not worth splitting
+                for (size_t i = begin; i < end; i++)
+                {
+                    function(i);
+                }
+                return;
+            }
+
+            typename std::remove_reference<F>::type* body = &function;
+            TaskGroup group;
+            size_t start = begin;
+            while (end - start > chunk)
+            {
+                size_t stop = start + chunk;
+                group.addTask([body, start, stop]() {
+                    for (size_t i = start; i < stop; i++)
+                    {
+                        (*body)(i);
+                    }
+                }, priority);
+                start = stop;
+            }
+
+            for (size_t i = start; i < end; i++)
+            {
+                function(i);
+            }
+            group.wait();
+        }
+
+        /*
+        A task that can depend on other jobs. It isn't queued until every job it depends on has finished.
+        Create these with createJob, add dependencies, then call submit
+        */
+        class Job: public std::enable_shared_from_this<Job>
+        {
+            private:
+                Task function;
+                TaskGroup* group;
+
+                // Dependencies that haven't finished yet, plus one until submit is called
+                std::atomic<int> waiting_on;
+
+                std::mutex lock;
+                bool finished = false;
+                std::vector<std::shared_ptr<Job>> dependents;
+
+                void run();
+                void release();
+
+            public:
+                Job(Task func, TaskGroup* task_group);
+
+                // Makes this job wait for `other` to finish before it starts. Must be called before submit
+                void dependsOn(std::shared_ptr<Job> other);
+
+                // Lets the job run as soon as its dependencies are done
+                void submit();
+
+                bool isDone();
+        };
+
+        // Creates a job. If a group is given, the job counts towards that group's wait()
+        std::shared_ptr<Job> createJob(Task function, TaskGroup* group = nullptr);
+
+        struct TaskStats
+        {
+            // Tasks that needed a heap allocation, either because they didn't fit inline or because they were added from a thread without an arena
+            unsigned long heap_tasks = 0;
+
+            // Blocks the task arenas have had to allocate. This stops growing once the arenas are big enough for a frame
+            unsigned long arena_blocks = 0;
+
+            // Memory held by the task arenas
+            size_t arena_bytes = 0;
+        };
+
+        // Tasks queued from the main thread and the workers are placed in a per-thread arena, which is rewound when waitForCompletion finishes on the main thread.
+        // Once the arenas have grown to fit a frame, queueing small tasks doesn't allocate anything
+        TaskStats getTaskStats();
+
+        // One task from a recorded or replayed frame
+        struct TaskTrace
+        {
+            // Identifies the task between runs. It's made from the key of the task that added it, and how many tasks that one had added before it
+            std::uint64_t key;
+
+            // The thread that ran it, numbered like getWorkerStats. -1 for threads outside the pool
+            int thread;
+
+            // Nanoseconds from the start of the frame until the task started, and how long it ran for
+            std::uint32_t start;
+            std::uint32_t duration;
+        };
+
+        /*
+        Records the order and timing of every Critical and Normal task for the next `frames` frames, then saves it to `filename` (through the ResourceManager).
+        A frame ends when waitForCompletion finishes on the main thread, which Document::tick does for you
+        */
+        void startRecording(std::string filename, int frames);
+        bool isRecording();
+
+        /*
+        Replays a recording made with startRecording. Until it runs out of frames, every frame task is run on the main thread, one at a time, in the order they started in the recording.
+        Tasks that aren't in the recording run after the ones that are, in the order they were added. Returns false if the file couldn't be loaded
+        */
+        bool startReplay(std::string filename);
+        bool isReplaying();
+
+        // The tasks of the last finished frame in the order they started. Only filled in while recording or replaying
+        std::vector<TaskTrace> getLastFrameTrace();
+
+        // How a thread in the pool has spent its time since profiling was turned on
+        struct WorkerStats
+        {
+            double busy_time = 0;
+            double idle_time = 0;
+            unsigned long tasks_run = 0;
+        };
+
+        // Turns on measuring of busy and idle time for every thread in the pool. Off by default, because it calls the clock around every task
+        void setProfiling(bool enabled);
+        bool getProfiling();
+
+        // Returns one entry per thread. The first one is the thread that called startThreads, the last one is the lesser thread
+        std::vector<WorkerStats> getWorkerStats();
+        void resetWorkerStats();
+    } // namespace Threading
+}
+
+#endif
@@ -2,6 +2,8 @@
 #include "Engine/Engine.hpp"
 #include "Engine/Log.hpp"
 #include "Engine/Res.hpp"
+#include "Engine/Scene.hpp"
+#include "Engine/Selector.hpp"
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -18,89 +20,148 @@ using namespace Engine::DOM;
 Element::Element(std::shared_ptr<Engine::Document> parent_document)
 : children(),
 // attributes(),
-id(""),
+id(),
 document(parent_document),
-classList()
+classList(this)
 {
     setTagName("element");
 }
 
 Element::~Element()
 {
-    
-}
+    document->unschedule(this);
 
-std::string Element::getTagName()
-{
-    return tag_name;
+    if (id_indexed)
+    {
+        document->unindexId(id, this);
+    }
+
+    type_container.forEachType([this](int type) {
+        document->removeFromIndex(false, type, this);
+    });
+
+    for (size_t i = 0; i < classList.classes.size(); i++)
+    {
+        document->removeFromIndex(true, document->class_types.getTypeOfElement(classList.classes[i]), this);
+    }
 }
 
 void Element::appendChild(std::shared_ptr<Element> child)
 {
-    if (child->hasParent())
+    auto old_parent = child->getParent();
+    if (old_parent != nullptr)
     {
         // Make sure it's not the a child of 2 elements
-        child->getParent()->removeChild(child);
+        old_parent->removeChild(child);
     }
 
-    child->setParent(shared_from_this());
+    auto self = shared_from_this();
+    child->setParent(self);
+    tree_lock.lock();
+    child->index_in_parent.store(children.size(), std::memory_order_relaxed);
     children.push_back(child);
+    tree_lock.unlock();
+    document->markTreeDirty();
 
-    // Call the event
-    child->onParentAdded();
+    // It might have been given an id before anything owned it
+    child->indexId();
+
+    // onParentAdded is called when this is delivered
+    document->recordMutation(child, nullptr, self);
 }
 
 void Element::removeChild(std::shared_ptr<Element> child)
 {
-    //children.remove(child);
-    for (size_t i = 0; i < children.size(); i++)
+    tree_lock.lock();
+    size_t index = findChild(child.get());
+    if (index == children.size())
+    {
+        tree_lock.unlock();
+        LOG_ERROR("Cannot remove child " + child->getTagName() + ": it isn't a child of this element");
+        return;
+    }
+
+    if (keep_child_order)
+    {
+        // The children after this one are left thinking they're one further along than they are. findChild copes with that
+        children.erase(children.begin() + index);
+    }
+    else
     {
-        if (children[i] == child)
+        if (index != children.size() - 1)
         {
-            children.erase(children.begin() + i);
-            break;
+            children[index] = std::move(children.back());
+            children[index]->index_in_parent.store(index, std::memory_order_relaxed);
         }
+        children.pop_back();
     }
+    tree_lock.unlock();
+    document->markTreeDirty();
     
     child->setParent(nullptr);
 
-    // Call the Evant
-    child->onParentRemoved();
+    // There might still be tasks queued for it this frame
+    document->deferRelease(child);
+
+    // onParentRemoved is called when this is delivered
+    document->recordMutation(child, shared_from_this(), nullptr);
 }
 
 bool Element::hasChild(std::shared_ptr<Element> child)
 {
-    auto it = std::find(children.begin(), children.end(), child);
-    if (it != children.end())
+    std::lock_guard<std::mutex> guard(tree_lock);
+    return findChild(child.get()) != children.size();
+}
+
+size_t Element::findChild(const Element* child) const
+{
+    size_t index = child->index_in_parent.load(std::memory_order_relaxed);
+    if (index < children.size() && children[index].get() == child)
     {
-        return true;
+        return index;
     }
-    else
+
+    // Children only ever move towards the front, so if it's here it's before where it thinks it is
+    size_t end = std::min(index + 1, children.size());
+    for (size_t i = 0; i < end; i++)
     {
-        return false;
+        if (children[i].get() == child)
+        {
+            child->index_in_parent.store(i, std::memory_order_relaxed);
+            return i;
+        }
     }
+    return children.size();
 }
 
 std::vector<std::shared_ptr<Element>> Element::getChildren() const
 {
+    std::lock_guard<std::mutex> guard(tree_lock);
     return children;
 }
 
+ChildRange Element::getChildRange() const
+{
+    return ChildRange(tree_lock, children);
+}
+
 void Element::setParent(std::shared_ptr<Element> new_parent)
 {
     LOG_ASSERT_MESSAGE_FATAL(hasParent() && new_parent != nullptr, "Could not run setParent: element has parent and new parent isn't nullptr");
     // Do not run removeChild here 
+    std::lock_guard<std::mutex> guard(tree_lock);
     parent = new_parent;
 }
 
 std::shared_ptr<Element> Element::getParent()
 {
-    return parent;
+    std::lock_guard<std::mutex> guard(tree_lock);
+    return parent.lock();
 }
 
 bool Element::hasParent()
 {
-    if (parent == nullptr)
+    if (getParent() == nullptr)
     {
         return false;
     }
@@ -110,118 +171,322 @@ bool Element::hasParent()
     }
 }
 
-std::string Element::getId()
+void Element::setId(const std::string& new_id)
+{
+    if (id_indexed)
+    {
+        document->unindexId(id, this);
+        id_indexed = false;
+    }
+
+    id = Engine::Atom(new_id);
+    indexId();
+}
+
+void Element::indexId()
 {
-    return id;
+    if (id_indexed || id.empty())
+    {
+        return;
+    }
+
+    // Nothing owns this yet if it's still being constructed. appendChild will try again
+    auto self = weak_from_this().lock();
+    if (self == nullptr)
+    {
+        return;
+    }
+
+    document->indexId(id, self);
+    id_indexed = true;
+}
+
+void Element::setVisible(bool new_vis)
+{
+    visible = new_vis;
+    document->markFlagsDirty();
 }
 
-void Element::setId(std::string new_id)
+void Element::setProcess(bool new_proc)
 {
-    id = new_id;
+    do_process = new_proc;
+    document->markFlagsDirty();
+}
+
+void Element::sleep()
+{
+    document->setSleeping(this, true, -1);
+}
+
+void Element::sleepFor(float seconds)
+{
+    document->setSleeping(this, true, seconds < 0 ? 0 : seconds);
+}
+
+void Element::wake()
+{
+    document->setSleeping(this, false, -1);
+}
+
+void Element::setProcessInterval(unsigned int frames)
+{
+    document->setProcessSchedule(this, frames, 0);
+}
+
+void Element::setProcessRate(float hz)
+{
+    document->setProcessSchedule(this, 1, hz > 0 ? 1.0f / hz : 0);
 }
 
 void Element::destroy()
 {
-    for (size_t i = 0; i < children.size(); i++)
+    auto old_parent = getParent();
+    if (old_parent != nullptr)
     {
-        children[i]->destroy();
+        old_parent->removeChild(shared_from_this());
     }
 
-    // This probably frees this element, but I'm not really sure
-    // self_ptr.reset();
+    // Take the whole subtree apart breadth first. Once every element's children have been moved into `subtree`,
+    // nothing in it owns anything else, so letting go of it frees each element on its own instead of recursing down the tree
+    std::vector<std::shared_ptr<Element>> subtree;
+    subtree.push_back(shared_from_this());
+    for (size_t i = 0; i < subtree.size(); i++)
+    {
+        Element* element = subtree[i].get();
+
+        std::lock_guard<std::mutex> guard(element->tree_lock);
+        for (size_t j = 0; j < element->children.size(); j++)
+        {
+            subtree.push_back(std::move(element->children[j]));
+        }
+        element->children.clear();
+        if (i > 0)
+        {
+            element->parent.reset();
+        }
+    }
+    document->markTreeDirty();
+
+    // There might still be tasks queued for them this frame
+    document->deferRelease(subtree);
 }
 
-void Element::setTagName(std::string tag)
+void Element::setTagName(const std::string& tag)
+{
+    setTagName(Engine::Atom(tag));
+}
+
+void Element::setTagName(Engine::Atom tag)
 {
     tag_name = tag;
 
     // Add it to the types database
-    type_container.setType(document->element_types.getTypeOfElement(tag_name));
+    int type = document->element_types.getTypeOfElement(tag_name);
+    if (type_container.isType(type) == false)
+    {
+        type_container.setType(type);
+        if (type_container.isType(type))
+        {
+            document->addToIndex(false, type, this);
+        }
+    }
 }
 
 // ==============================================
-// Selectors
+// Tree walking
 
-std::shared_ptr<Element> Element::getElementById(std::string id)
+TreeIterator::TreeIterator(Element* root)
+: stack(),
+current(nullptr),
+skip(false)
+{
+    stack.push_back(Level {root, 0});
+    advance();
+}
+
+void TreeIterator::next()
 {
-    for (size_t i = 0; i < children.size(); i++)
+    if (current == nullptr)
     {
-        if (children[i]->getId() == id)
+        return;
+    }
+
+    if (skip == false)
+    {
+        stack.push_back(Level {current, 0});
+    }
+    skip = false;
+    advance();
+}
+
+void TreeIterator::advance()
+{
+    while (stack.size() > 0)
+    {
+        Level& level = stack.back();
+
+        std::lock_guard<std::mutex> guard(level.element->tree_lock);
+        if (level.next < level.element->children.size())
         {
-            return children[i];
-        }
-        else {
-            auto res = children[i]->getElementById(id);
-            if (res != nullptr)
-            {
-                return res;
-            }
+            current = level.element->children[level.next].get();
+            level.next++;
+            return;
         }
+
+        stack.pop_back();
     }
-    LOG_WARN("Could not find element with given id");
-    return nullptr;
+
+    current = nullptr;
+}
+
+// ==============================================
+// Selectors
+
+std::shared_ptr<Element> Element::getElementById(std::string id)
+{
+    return document->findElementById(id, this);
 }
 
 std::vector<std::shared_ptr<Element>> Element::getElementsByTagName(std::string tag, bool derived)
+{
+    // Nothing can have a tag that's never been interned
+    std::vector<std::shared_ptr<Element>> output;
+    Engine::Atom atom = Engine::Atom::find(tag);
+    if (!atom.empty())
+    {
+        // Everything with the tag has its type, so the type's index is searched either way
+        collectIndexed(false, document->element_types.getTypeOfElement(atom), derived ? Engine::Atom() : atom, output);
+    }
+    return output;
+}
+
+void Element::getElementsByTagName(std::string tag, bool derived, Memory::FrameVector<std::shared_ptr<Element>>& output)
+{
+    Engine::Atom atom = Engine::Atom::find(tag);
+    if (!atom.empty())
+    {
+        collectIndexed(false, document->element_types.getTypeOfElement(atom), derived ? Engine::Atom() : atom, output);
+    }
+}
+
+std::vector<std::shared_ptr<Element>> Element::getElementsByClassName(std::string clas)
 {
     std::vector<std::shared_ptr<Element>> output;
+    Engine::Atom atom = Engine::Atom::find(clas);
+    if (!atom.empty())
+    {
+        collectIndexed(true, document->class_types.getTypeOfElement(atom), atom, output);
+    }
+    return output;
+}
+
+void Element::getElementsByClassName(std::string clas, Memory::FrameVector<std::shared_ptr<Element>>& output)
+{
+    Engine::Atom atom = Engine::Atom::find(clas);
+    if (!atom.empty())
+    {
+        collectIndexed(true, document->class_types.getTypeOfElement(atom), atom, output);
+    }
+}
 
-    for (size_t i = 0; i < children.size(); i++)
+template<typename V>
+void Element::collectIndexed(bool by_class, int id, Engine::Atom tag, V& output)
+{
+    Memory::FrameVector<Element*> found;
+    if (document->findIndexed(by_class, id, this, found))
     {
-        if (derived == false)
+        for (size_t i = 0; i < found.size(); i++)
         {
-            if (children[i]->getTagName() == tag)
+            if (by_class || tag.empty() || found[i]->tag_name == tag)
             {
-                output.push_back(children[i]);
+                output.push_back(found[i]->shared_from_this());
             }
         }
+        return;
+    }
+
+    // The tree's changed since the document last flattened it, so walk it instead
+    for (TreeIterator it(this); !it.done(); it.next())
+    {
+        bool match;
+        if (by_class)
+        {
+            match = it->classList.has(tag);
+        }
+        else if (tag.empty())
+        {
+            match = it->type_container.isType(id);
+        }
         else
         {
-            if (children[i]->type_container.isType(document->element_types.getTypeOfElement(tag)))
-            {
-                output.push_back(children[i]);
-            }
+            match = it->tag_name == tag;
         }
 
-        auto more = children[i]->getElementsByTagName(tag, derived);
-        if (more.size() > 0)
+        if (match)
         {
-            output.insert(output.end(), more.begin(), more.end());
+            output.push_back(it->shared_from_this());
         }
     }
+}
 
+std::shared_ptr<Element> Element::querySelector(const std::string& selector)
+{
+    Memory::FrameVector<Element*> found;
+    document->getSelector(selector)->query(this, found, true);
+    if (found.size() == 0)
+    {
+        return nullptr;
+    }
+    return found[0]->shared_from_this();
+}
+
+std::vector<std::shared_ptr<Element>> Element::querySelectorAll(const std::string& selector)
+{
+    Memory::FrameVector<Element*> found;
+    document->getSelector(selector)->query(this, found, false);
+
+    std::vector<std::shared_ptr<Element>> output;
+    output.reserve(found.size());
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        output.push_back(found[i]->shared_from_this());
+    }
     return output;
 }
 
+void Element::querySelectorAll(const std::string& selector, Memory::FrameVector<std::shared_ptr<Element>>& output)
+{
+    Memory::FrameVector<Element*> found;
+    document->getSelector(selector)->query(this, found, false);
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        output.push_back(found[i]->shared_from_this());
+    }
+}
+
 std::vector<std::shared_ptr<Element>> Element::getParentsByTagName(std::string tag, bool derived)
 {
     std::vector<std::shared_ptr<Element>> output;
-    
-    if (getParent() != nullptr)
+
+    Engine::Atom atom = Engine::Atom::find(tag);
+    if (atom.empty())
     {
-        if (derived == false)
+        return output;
+    }
+    int type = document->element_types.getTypeOfElement(atom);
+
+    // Goes up for as long as the parents match
+    auto parent = getParent();
+    while (parent != nullptr)
+    {
+        bool match = derived ? parent->type_container.isType(type) : parent->tag_name == atom;
+        if (!match)
         {
-            if (getParent()->getTagName() == tag_name)
-            {
-                output.push_back(getParent());
-                auto more = getParent()->getParentsByTagName(tag);
-                if (more.size() > 0)
-                {
-                    output.insert(output.end(), more.begin(), more.end());
-                }
-            }
-        }
-        else {
-            if (getParent()->type_container.isType(document->element_types.getTypeOfElement(tag)))
-            {
-                output.push_back(getParent());
-                auto more = getParent()->getParentsByTagName(tag);
-                if (more.size() > 0)
-                {
-                    output.insert(output.end(), more.begin(), more.end());
-                }
-            }
+            break;
         }
+
+        output.push_back(parent);
+        parent = parent->getParent();
     }
 
     return output;
@@ -229,17 +494,19 @@ std::vector<std::shared_ptr<Element>> Element::getParentsByTagName(std::string t
 
 bool Element::contains(std::shared_ptr<Element> element)
 {
-    for (size_t i = 0; i < children.size(); i++)
+    return element != nullptr && element->isDescendantOf(this);
+}
+
+bool Element::isDescendantOf(const Element* ancestor)
+{
+    auto current = getParent();
+    while (current != nullptr)
     {
-        if (children[i] == element)
-        {
-            return true;
-        }
-        
-        if (children[i]->contains(element))
+        if (current.get() == ancestor)
         {
             return true;
         }
+        current = current->getParent();
     }
 
     return false;
@@ -248,35 +515,79 @@ bool Element::contains(std::shared_ptr<Element> element)
 // =======================================================
 // Attributes
 
-void Element::setAttribute(std::string attribute, AttrVariant value)
+// Where attribute is in the attributes, or where it would go
+std::vector<std::pair<Engine::Atom, AttrVariant>>::const_iterator findAttributeSlot(const std::vector<std::pair<Engine::Atom, AttrVariant>>& attributes, Engine::Atom attribute)
 {
-    attributes[attribute] = value;
+    return std::lower_bound(attributes.begin(), attributes.end(), attribute, [](const std::pair<Engine::Atom, AttrVariant>& entry, Engine::Atom key)
+    {
+        return entry.first < key;
+    });
 }
 
-AttrVariant Element::getAttribute(std::string attribute)
+void Element::setAttribute(const std::string& attribute, AttrVariant value)
 {
-    return attributes.at(attribute);
+    setAttribute(Engine::Atom(attribute), value);
 }
 
-bool Element::hasAttribute(std::string attribute)
+void Element::setAttribute(Engine::Atom attribute, AttrVariant value)
 {
-    try
+    auto slot = findAttributeSlot(attributes, attribute);
+    if (slot != attributes.end() && slot->first == attribute)
     {
-        attributes.at(attribute);
-        return true;
+        attributes[slot - attributes.begin()].second = std::move(value);
+        return;
     }
-    catch(const std::exception& e)
+
+    attributes.insert(slot, std::make_pair(attribute, std::move(value)));
+}
+
+const AttrVariant* Element::findAttribute(Engine::Atom attribute) const
+{
+    if (attribute.empty())
     {
-        return false;
+        return nullptr;
     }
-    
+
+    auto slot = findAttributeSlot(attributes, attribute);
+    if (slot != attributes.end() && slot->first == attribute)
+    {
+        return &slot->second;
+    }
+    return nullptr;
+}
+
+AttrVariant Element::getAttribute(const std::string& attribute) const
+{
+    // Anything that isn't interned can't be an attribute, so don't intern it just to look for it
+    return getAttribute(Engine::Atom::find(attribute));
+}
+
+AttrVariant Element::getAttribute(Engine::Atom attribute) const
+{
+    const AttrVariant* found = findAttribute(attribute);
+    if (found == nullptr)
+    {
+        return AttrVariant();
+    }
+    return *found;
+}
+
+bool Element::hasAttribute(const std::string& attribute) const
+{
+    return findAttribute(Engine::Atom::find(attribute)) != nullptr;
+}
+
+bool Element::hasAttribute(Engine::Atom attribute) const
+{
+    return findAttribute(attribute) != nullptr;
 }
 
 // =======================================================
 // ClassList
 
-ClassList::ClassList()
-: classes()
+ClassList::ClassList(Element* owner)
+: owner(owner),
+classes()
 {
 
 }
@@ -286,50 +597,83 @@ ClassList::~ClassList()
 
 }
 
-void ClassList::add(std::string element_class)
+// Where element_class is in classes, or where it would go
+std::vector<Engine::Atom>::const_iterator findClassSlot(const std::vector<Engine::Atom>& classes, Engine::Atom element_class)
+{
+    return std::lower_bound(classes.begin(), classes.end(), element_class);
+}
+
+void ClassList::add(const std::string& element_class)
+{
+    add(Engine::Atom(element_class));
+}
+
+void ClassList::add(Engine::Atom element_class)
 {
-    if (!has(element_class))
+    auto slot = findClassSlot(classes, element_class);
+    if (slot == classes.end() || *slot != element_class)
     {
-        classes.push_back(element_class);
+        classes.insert(slot, element_class);
+        owner->document->addToIndex(true, owner->document->class_types.getTypeOfElement(element_class), owner);
     }
 }
 
-void ClassList::remove(std::string element_class)
+void ClassList::remove(const std::string& element_class)
 {
-    if (!has(element_class))
+    Engine::Atom atom = Engine::Atom::find(element_class);
+    if (atom.empty())
     {
         LOG_ERROR("Cannot remove class " + element_class + ": Element does not contain this class");
         return;
     }
+    remove(atom);
+}
 
-    for (size_t i = 0; i < classes.size(); i++)
+void ClassList::remove(Engine::Atom element_class)
+{
+    auto slot = findClassSlot(classes, element_class);
+    if (slot == classes.end() || *slot != element_class)
     {
-        if (classes[i] == element_class)
-        {
-            classes.erase(classes.begin() + i);
-            break;
-        }
+        LOG_ERROR("Cannot remove class " + element_class.str() + ": Element does not contain this class");
+        return;
     }
+
+    classes.erase(slot);
+    owner->document->removeFromIndex(true, owner->document->class_types.getTypeOfElement(element_class), owner);
 }
 
-bool ClassList::has(std::string element_class)
+bool ClassList::has(const std::string& element_class) const
 {
-    for (size_t i = 0; i < classes.size(); i++)
+    return has(Engine::Atom::find(element_class));
+}
+
+bool ClassList::has(Engine::Atom element_class) const
+{
+    if (element_class.empty())
     {
-        if (classes[i] == element_class)
-        {
-            return true;
-        }
+        return false;
     }
 
-    return false;
+    auto slot = findClassSlot(classes, element_class);
+    return slot != classes.end() && *slot == element_class;
 }
 
 
 // ==============================================================
 // Saving
-void Element::saveToFile(std::string filename)
+void Element::saveToFile(std::string filename, SceneFormat format)
 {
+    if (format == SceneFormat::binary)
+    {
+        Scene::Writer writer;
+        writeScene(writer);
+
+        auto res = std::make_shared<Res::TextResource>();
+        res->setText(writer.finish());
+        Res::ResourceManager::save(filename, res, false, Res::FileType::binary);
+        return;
+    }
+
     auto doc = new tinyxml2::XMLDocument();
 
     doc->InsertEndChild(elementToXMLElement(shared_from_this(), doc));
@@ -353,24 +697,21 @@ tinyxml2::XMLElement* Element::elementToXMLElement(std::shared_ptr<Element> ele,
     ele->onSave();
     auto new_ele = doc->NewElement(ele->getTagName().c_str());
 
-    for (auto i = ele->attributes.begin(); i != ele->attributes.end(); i++)
+    // Attributes are stored in atom order, which depends on what got interned first. Save them by name so files come out the same every time
+    std::vector<const std::pair<Engine::Atom, AttrVariant>*> sorted;
+    sorted.reserve(ele->attributes.size());
+    for (size_t i = 0; i < ele->attributes.size(); i++)
     {
-        if (std::get_if<int>(&i->second))
-        {
-            new_ele->SetAttribute(i->first.c_str(), std::get<int>(i->second));
-        }
-        else if (std::get_if<float>(&i->second))
-        {
-            new_ele->SetAttribute(i->first.c_str(), std::get<float>(i->second));
-        }
-        // else if (std::get_if<bool>(&i->second))
-        // {
-        //     new_ele->SetAttribute(i->first.c_str(), std::get<bool>(i->second));
-        // }
-        else if (std::get_if<std::string>(&i->second))
-        {
-            new_ele->SetAttribute(i->first.c_str(), std::get<std::string>(i->second).c_str());
-        }
+        sorted.push_back(&ele->attributes[i]);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<Engine::Atom, AttrVariant>* a, const std::pair<Engine::Atom, AttrVariant>* b)
+    {
+        return a->first.str() < b->first.str();
+    });
+
+    for (auto i : sorted)
+    {
+        Scene::setXMLAttribute(new_ele, i->first.str(), i->second);
     }
 
     if (ele->getId() != "")
@@ -378,21 +719,81 @@ tinyxml2::XMLElement* Element::elementToXMLElement(std::shared_ptr<Element> ele,
         new_ele->SetAttribute("id", ele->getId().c_str());
     }
 
+    // Classes are sorted by name as well
+    std::vector<std::string> class_names;
+    for (size_t i = 0; i < ele->classList.classes.size(); i++)
+    {
+        class_names.push_back(ele->classList.classes[i].str());
+    }
+    std::sort(class_names.begin(), class_names.end());
+
     std::string classes = "";
-    for (int i = 0; i < ele->classList.classes.size(); i++) 
+    for (size_t i = 0; i < class_names.size(); i++)
     {
-        classes += ele->classList.classes[i];
-        if (i != ele->classList.classes.size()-1)
+        classes += class_names[i];
+        if (i != class_names.size()-1)
         {
             classes += " ";
         }
     }
+    if (classes != "")
+    {
+        new_ele->SetAttribute("class", classes.c_str());
+    }
 
-    for (int i = 0; i < ele->children.size(); i ++) 
+    auto children = ele->getChildren();
+    for (int i = 0; i < children.size(); i ++) 
     {
-        new_ele->InsertEndChild(elementToXMLElement(ele->children[i], doc));
+        new_ele->InsertEndChild(elementToXMLElement(children[i], doc));
     }
 
     return new_ele;
 }
 
+void Element::writeScene(Scene::Writer& writer)
+{
+    // Pre-order with an explicit stack, the same order the reader builds the tree in, so deep scenes can be saved without running out of stack
+    std::vector<std::shared_ptr<Element>> stack {shared_from_this()};
+    while (!stack.empty())
+    {
+        auto element = stack.back();
+        stack.pop_back();
+
+        auto children = element->writeSceneRecord(writer);
+
+        // Pushed backwards so the first child comes off the stack next
+        for (size_t i = children.size(); i > 0; i--)
+        {
+            stack.push_back(children[i - 1]);
+        }
+    }
+}
+
+std::vector<std::shared_ptr<Element>> Element::writeSceneRecord(Scene::Writer& writer)
+{
+    onSave();
+
+    // Sorted by name, the same as the XML, so saving the same elements always gives the same file
+    std::vector<std::pair<std::string, AttrVariant>> sorted;
+    sorted.reserve(attributes.size());
+    for (size_t i = 0; i < attributes.size(); i++)
+    {
+        sorted.emplace_back(attributes[i].first.str(), attributes[i].second);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, AttrVariant>& a, const std::pair<std::string, AttrVariant>& b)
+    {
+        return a.first < b.first;
+    });
+
+    std::vector<std::string> classes;
+    for (size_t i = 0; i < classList.classes.size(); i++)
+    {
+        classes.push_back(classList.classes[i].str());
+    }
+    std::sort(classes.begin(), classes.end());
+
+    auto children = getChildren();
+    writer.addElement(getTagName(), (glm::uint32)children.size(), getId(), classes, sorted);
+    return children;
+}
+
@@ -0,0 +1,544 @@
+#include "Engine/Scene.hpp"
+#include "Engine/Log.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "glm/gtc/type_ptr.hpp"
+#include <tinyxml2.h>
+
+using namespace Engine;
+
+bool Scene::isBinaryScene(const std::string& data)
+{
+    return data.size() >= sizeof(magic) && data.compare(0, sizeof(magic), magic, sizeof(magic)) == 0;
+}
+
+bool is_int(const std::string & s)
+{
+    return !s.empty() && (s.find_first_not_of( "-0123456789" ) == std::string::npos);
+}
+
+bool is_float(const std::string & s)
+{
+    return !s.empty() && (s.find_first_not_of( ".0123456789" ) == std::string::npos);
+}
+
+// Reads 16 space separated numbers, the way Element3D has always saved its transform
+bool parseMatrix(const std::string& text, glm::mat4& output)
+{
+    float values[16];
+    const char* start = text.c_str();
+    for (int i = 0; i < 16; i++)
+    {
+        char* end;
+        values[i] = std::strtof(start, &end);
+        char expected = i < 15 ? ' ' : '\0';
+        if (end == start || *end != expected)
+        {
+            return false;
+        }
+        start = end;
+    }
+
+    output = glm::make_mat4(values);
+    return true;
+}
+
+DOM::AttrVariant Scene::parseAttribute(const std::string& text)
+{
+    try
+    {
+        if (is_int(text))
+        {
+            return std::stoi(text);
+        }
+        if (is_float(text))
+        {
+            return std::stof(text);
+        }
+    }
+    catch (std::exception&)
+    {
+        // Something like "1-2" or "1.2.3". It's a string after all
+        return text;
+    }
+
+    // Only worth trying if there's room for 16 numbers
+    glm::mat4 matrix;
+    if (std::count(text.begin(), text.end(), ' ') == 15 && parseMatrix(text, matrix))
+    {
+        return matrix;
+    }
+
+    return text;
+}
+
+void Scene::setXMLAttribute(tinyxml2::XMLElement* node, const std::string& name, const DOM::AttrVariant& value)
+{
+    if (std::holds_alternative<unsigned int>(value))
+    {
+        node->SetAttribute(name.c_str(), std::get<unsigned int>(value));
+    }
+    else if (std::holds_alternative<int>(value))
+    {
+        node->SetAttribute(name.c_str(), std::get<int>(value));
+    }
+    else if (std::holds_alternative<float>(value))
+    {
+        node->SetAttribute(name.c_str(), std::get<float>(value));
+    }
+    else if (std::holds_alternative<std::string>(value))
+    {
+        node->SetAttribute(name.c_str(), std::get<std::string>(value).c_str());
+    }
+    else
+    {
+        const glm::mat4& matrix = std::get<glm::mat4>(value);
+        std::string text;
+        for (int i = 0; i < 4; i++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                if (i != 0 || j != 0)
+                {
+                    text += " ";
+                }
+                text += std::to_string(matrix[i][j]);
+            }
+        }
+        node->SetAttribute(name.c_str(), text.c_str());
+    }
+}
+
+// ==============================================
+// Writing
+
+glm::uint32 Scene::Writer::addString(const std::string& text)
+{
+    auto found = string_index.find(text);
+    if (found != string_index.end())
+    {
+        return found->second;
+    }
+
+    glm::uint32 index = (glm::uint32)strings.size();
+    auto inserted = string_index.emplace(text, index).first;
+    strings.push_back(&inserted->first);
+    return index;
+}
+
+void Scene::Writer::addElement(const std::string& tag, glm::uint32 child_count, const std::string& id, const std::vector<std::string>& classes,
+                                const std::vector<std::pair<std::string, DOM::AttrVariant>>& attributes)
+{
+    element_count++;
+    write<glm::uint32>(addString(tag));
+    write<glm::uint32>(child_count);
+    write<glm::uint32>(id.empty() ? no_string : addString(id));
+
+    write<glm::uint32>((glm::uint32)classes.size());
+    for (size_t i = 0; i < classes.size(); i++)
+    {
+        write<glm::uint32>(addString(classes[i]));
+    }
+
+    write<glm::uint32>((glm::uint32)attributes.size());
+    for (size_t i = 0; i < attributes.size(); i++)
+    {
+        const DOM::AttrVariant& value = attributes[i].second;
+        write<glm::uint32>(addString(attributes[i].first));
+        write<glm::uint8>((glm::uint8)value.index());
+
+        switch (value.index())
+        {
+            case unsigned_attr:
+                write<glm::uint32>(std::get<unsigned int>(value));
+                break;
+            case int_attr:
+                write<glm::int32>(std::get<int>(value));
+                break;
+            case float_attr:
+                write<float>(std::get<float>(value));
+                break;
+            case string_attr:
+                write<glm::uint32>(addString(std::get<std::string>(value)));
+                break;
+            case matrix_attr:
+                write<glm::mat4>(std::get<glm::mat4>(value));
+                break;
+        }
+    }
+}
+
+std::string Scene::Writer::finish()
+{
+    std::string output;
+    size_t table_size = 0;
+    for (size_t i = 0; i < strings.size(); i++)
+    {
+        table_size += sizeof(glm::uint32) + strings[i]->size();
+    }
+    output.reserve(sizeof(magic) + sizeof(glm::uint16) + sizeof(glm::uint32) * 2 + table_size + elements.size());
+
+    auto append = [&output](auto value) {
+        output.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+
+    output.append(magic, sizeof(magic));
+    append(format_version);
+
+    append((glm::uint32)strings.size());
+    for (size_t i = 0; i < strings.size(); i++)
+    {
+        append((glm::uint32)strings[i]->size());
+        output += *strings[i];
+    }
+
+    append(element_count);
+    output += elements;
+    return output;
+}
+
+// ==============================================
+// Reading
+
+Scene::Reader::Reader(const std::string& input)
+: data(input)
+{
+    glm::uint32 string_count;
+    if (!isBinaryScene(data))
+    {
+        LOG_ERROR("Not a binary scene");
+        return;
+    }
+    offset = sizeof(magic);
+
+    if (!read(version) || version < 1 || version > format_version)
+    {
+        LOG_ERROR("Binary scene is from a different version");
+        return;
+    }
+
+    if (!read(string_count))
+    {
+        LOG_ERROR("Binary scene is truncated");
+        return;
+    }
+
+    // Every string needs at least its length, so a count bigger than that is a broken file, not a huge allocation
+    if (string_count > (data.size() - offset) / sizeof(glm::uint32))
+    {
+        LOG_ERROR("Binary scene's string table is broken");
+        return;
+    }
+
+    strings.reserve(string_count);
+    for (glm::uint32 i = 0; i < string_count; i++)
+    {
+        glm::uint32 length;
+        if (!read(length) || length > data.size() - offset)
+        {
+            LOG_ERROR("Binary scene is truncated");
+            return;
+        }
+        strings.emplace_back(data, offset, length);
+        offset += length;
+    }
+
+    if (!read(element_count))
+    {
+        LOG_ERROR("Binary scene is truncated");
+        return;
+    }
+
+    valid = true;
+}
+
+bool Scene::Reader::readString(glm::uint32& index)
+{
+    return read(index) && index < strings.size();
+}
+
+bool Scene::Reader::readCount(glm::uint32& count, size_t entry_size)
+{
+    if (version == 1)
+    {
+        glm::uint16 short_count;
+        if (!read(short_count))
+        {
+            return false;
+        }
+        count = short_count;
+    }
+    else if (!read(count))
+    {
+        return false;
+    }
+
+    // A broken file could ask for billions, so don't make room for more than could possibly be there
+    return count <= (data.size() - offset) / entry_size;
+}
+
+bool Scene::Reader::readElement(ElementRecord& output)
+{
+    glm::uint32 class_count;
+    glm::uint32 attribute_count;
+    if (!readString(output.tag) || !read(output.child_count) || !read(output.id) || (output.id != no_string && output.id >= strings.size()) ||
+        !readCount(class_count, sizeof(glm::uint32)))
+    {
+        return false;
+    }
+
+    output.classes.resize(class_count);
+    for (glm::uint32 i = 0; i < class_count; i++)
+    {
+        if (!readString(output.classes[i]))
+        {
+            return false;
+        }
+    }
+
+    // The smallest attribute is a name, a type and a 4 byte value
+    if (!readCount(attribute_count, sizeof(glm::uint32) * 2 + sizeof(glm::uint8)))
+    {
+        return false;
+    }
+
+    output.attributes.clear();
+    output.attributes.reserve(attribute_count);
+    for (glm::uint32 i = 0; i < attribute_count; i++)
+    {
+        glm::uint32 name;
+        glm::uint8 type;
+        if (!readString(name) || !read(type))
+        {
+            return false;
+        }
+
+        DOM::AttrVariant value;
+        switch (type)
+        {
+            case unsigned_attr:
+            {
+                glm::uint32 number;
+                if (!read(number))
+                {
+                    return false;
+                }
+                value = (unsigned int)number;
+                break;
+            }
+            case int_attr:
+            {
+                glm::int32 number;
+                if (!read(number))
+                {
+                    return false;
+                }
+                value = (int)number;
+                break;
+            }
+            case float_attr:
+            {
+                float number;
+                if (!read(number))
+                {
+                    return false;
+                }
+                value = number;
+                break;
+            }
+            case string_attr:
+            {
+                glm::uint32 text;
+                if (!readString(text))
+                {
+                    return false;
+                }
+                value = strings[text];
+                break;
+            }
+            case matrix_attr:
+            {
+                glm::mat4 matrix;
+                if (!read(matrix))
+                {
+                    return false;
+                }
+                value = matrix;
+                break;
+            }
+            default:
+                return false;
+        }
+
+        output.attributes.emplace_back(name, std::move(value));
+    }
+
+    return true;
+}
+
+// ==============================================
+// Converting
+
+void xmlNodeToScene(tinyxml2::XMLElement* node, Scene::Writer& writer)
+{
+    std::vector<std::pair<std::string, DOM::AttrVariant>> attributes;
+    std::string id;
+    std::vector<std::string> classes;
+
+    for (const tinyxml2::XMLAttribute* attribute = node->FirstAttribute(); attribute != nullptr; attribute = attribute->Next())
+    {
+        attributes.emplace_back(attribute->Name(), Scene::parseAttribute(attribute->Value()));
+        const DOM::AttrVariant& value = attributes.back().second;
+
+        // Loading the XML only takes these from string attributes, so the same goes here
+        if (attributes.back().first == "id" && std::holds_alternative<std::string>(value))
+        {
+            id = std::get<std::string>(value);
+        }
+        else if (attributes.back().first == "class" && std::holds_alternative<std::string>(value))
+        {
+            const std::string& text = std::get<std::string>(value);
+            size_t start = 0;
+            while (start <= text.size())
+            {
+                size_t end = text.find(' ', start);
+                if (end == std::string::npos)
+                {
+                    end = text.size();
+                }
+                if (end > start)
+                {
+                    classes.push_back(text.substr(start, end - start));
+                }
+                start = end + 1;
+            }
+        }
+    }
+
+    glm::uint32 child_count = 0;
+    for (tinyxml2::XMLElement* child = node->FirstChildElement(); child != nullptr; child = child->NextSiblingElement())
+    {
+        child_count++;
+    }
+
+    writer.addElement(node->Name(), child_count, id, classes, attributes);
+
+    for (tinyxml2::XMLElement* child = node->FirstChildElement(); child != nullptr; child = child->NextSiblingElement())
+    {
+        xmlNodeToScene(child, writer);
+    }
+}
+
+bool Scene::xmlToBinary(const std::string& xml, std::string& output)
+{
+    tinyxml2::XMLDocument doc;
+    if (doc.Parse(xml.c_str(), xml.size()) != tinyxml2::XML_SUCCESS)
+    {
+        LOG_ERROR("Could not convert scene: the XML couldn't be parsed");
+        return false;
+    }
+
+    auto base = doc.FirstChildElement();
+    if (base == nullptr)
+    {
+        LOG_ERROR("Could not convert scene: there aren't any elements");
+        return false;
+    }
+
+    Writer writer;
+    xmlNodeToScene(base, writer);
+    output = writer.finish();
+    return true;
+}
+
+bool Scene::binaryToXML(const std::string& data, std::string& output)
+{
+    Reader reader(data);
+    if (!reader.isValid())
+    {
+        return false;
+    }
+    const std::vector<std::string>& strings = reader.getStrings();
+
+    tinyxml2::XMLDocument doc;
+    tinyxml2::XMLElement* base = nullptr;
+
+    // The elements still waiting for children, and how many they're waiting for
+    std::vector<std::pair<tinyxml2::XMLElement*, glm::uint32>> open;
+
+    ElementRecord record;
+    for (glm::uint32 i = 0; i < reader.getElementCount(); i++)
+    {
+        if (!reader.readElement(record) || (base != nullptr && open.empty()))
+        {
+            LOG_ERROR("Could not convert scene: the binary scene is broken");
+            return false;
+        }
+
+        tinyxml2::XMLElement* node = doc.NewElement(strings[record.tag].c_str());
+
+        // Attributes are saved sorted by name already, so they come out in the same order as saving XML directly
+        bool has_id = false;
+        bool has_class = false;
+        for (size_t j = 0; j < record.attributes.size(); j++)
+        {
+            const std::string& name = strings[record.attributes[j].first];
+            has_id = has_id || name == "id";
+            has_class = has_class || name == "class";
+            setXMLAttribute(node, name, record.attributes[j].second);
+        }
+
+        if (record.id != no_string && !has_id)
+        {
+            node->SetAttribute("id", strings[record.id].c_str());
+        }
+
+        if (record.classes.size() > 0 && !has_class)
+        {
+            std::string classes;
+            for (size_t j = 0; j < record.classes.size(); j++)
+            {
+                if (j != 0)
+                {
+                    classes += " ";
+                }
+                classes += strings[record.classes[j]];
+            }
+            node->SetAttribute("class", classes.c_str());
+        }
+
+        if (base == nullptr)
+        {
+            base = node;
+            doc.InsertEndChild(node);
+        }
+        else
+        {
+            open.back().first->InsertEndChild(node);
+            open.back().second--;
+        }
+
+        if (record.child_count > 0)
+        {
+            open.emplace_back(node, record.child_count);
+        }
+        while (!open.empty() && open.back().second == 0)
+        {
+            open.pop_back();
+        }
+    }
+
+    if (base == nullptr || !open.empty())
+    {
+        LOG_ERROR("Could not convert scene: the binary scene is truncated");
+        return false;
+    }
+
+    tinyxml2::XMLPrinter printer;
+    doc.Print(&printer);
+    output = printer.CStr();
+    return true;
+}
@@ -0,0 +1,525 @@
+#include "Engine/Selector.hpp"
+#include "Engine/Log.hpp"
+#include <string>
+#include <variant>
+
+using namespace Engine::DOM;
+
+Selector::Selector(const std::string& text, Document* document)
+: compounds(),
+valid(false)
+{
+    valid = parse(text, document);
+    if (!valid)
+    {
+        compounds.clear();
+    }
+}
+
+bool isNameCharacter(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+}
+
+bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Reads a tag, id, class or attribute name starting at position. Returns an empty string if there isn't one
+std::string readName(const std::string& text, size_t& position)
+{
+    size_t start = position;
+    while (position < text.size() && isNameCharacter(text[position]))
+    {
+        position++;
+    }
+    return text.substr(start, position - start);
+}
+
+bool Selector::parse(const std::string& text, Document* document)
+{
+    size_t position = 0;
+    bool child = false;
+
+    while (true)
+    {
+        // Combinators. Spaces on their own mean any descendant, and a > means a direct child
+        bool had_space = false;
+        while (position < text.size() && (isSpace(text[position]) || text[position] == '>'))
+        {
+            if (text[position] == '>')
+            {
+                if (child)
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": two > in a row");
+                    return false;
+                }
+                child = true;
+            }
+            had_space = true;
+            position++;
+        }
+
+        if (position >= text.size())
+        {
+            if (child)
+            {
+                LOG_ERROR("Invalid selector \"" + text + "\": nothing after >");
+                return false;
+            }
+            break;
+        }
+
+        if (compounds.size() > 0 && !had_space)
+        {
+            LOG_ERROR("Invalid selector \"" + text + "\": unexpected '" + text[position] + "'");
+            return false;
+        }
+        if (compounds.size() == 0 && child)
+        {
+            LOG_ERROR("Invalid selector \"" + text + "\": nothing before >");
+            return false;
+        }
+
+        Compound compound;
+        compound.child = child;
+        child = false;
+
+        // The parts of one compound, until a space or a >
+        bool empty = true;
+        while (position < text.size() && !isSpace(text[position]) && text[position] != '>')
+        {
+            char c = text[position];
+            if (isNameCharacter(c))
+            {
+                if (!compound.tag.empty() || !empty)
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": the tag has to come first");
+                    return false;
+                }
+                compound.tag = Atom(readName(text, position));
+            }
+            else if (c == '*')
+            {
+                if (!empty)
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": * has to come first");
+                    return false;
+                }
+                position++;
+            }
+            else if (c == '#' || c == '.')
+            {
+                position++;
+                std::string name = readName(text, position);
+                if (name.empty())
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": expected a name after " + c);
+                    return false;
+                }
+
+                if (c == '#')
+                {
+                    compound.id = Atom(name);
+                }
+                else
+                {
+                    compound.classes.push_back(Atom(name));
+                    compound.class_ids.push_back(document->class_types.getTypeOfElement(compound.classes.back()));
+                }
+            }
+            else if (c == '[')
+            {
+                position++;
+                Attribute attribute;
+                std::string name = readName(text, position);
+                attribute.has_value = false;
+                if (name.empty())
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": expected an attribute name after [");
+                    return false;
+                }
+                attribute.name = Atom(name);
+
+                if (position < text.size() && text[position] == '=')
+                {
+                    position++;
+                    attribute.has_value = true;
+
+                    if (position < text.size() && (text[position] == '"' || text[position] == '\''))
+                    {
+                        char quote = text[position];
+                        size_t end = text.find(quote, position + 1);
+                        if (end == std::string::npos)
+                        {
+                            LOG_ERROR("Invalid selector \"" + text + "\": missing closing quote");
+                            return false;
+                        }
+                        attribute.value = text.substr(position + 1, end - position - 1);
+                        position = end + 1;
+                    }
+                    else
+                    {
+                        size_t end = text.find(']', position);
+                        if (end == std::string::npos)
+                        {
+                            end = text.size();
+                        }
+                        attribute.value = text.substr(position, end - position);
+                        position = end;
+                    }
+                }
+
+                if (position >= text.size() || text[position] != ']')
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": missing ]");
+                    return false;
+                }
+                position++;
+                compound.attributes.push_back(attribute);
+            }
+            else if (c == ':' && text.compare(position, 6, ":type(") == 0)
+            {
+                if (!empty)
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": :type() has to come first");
+                    return false;
+                }
+                position += 6;
+                compound.tag = Atom(readName(text, position));
+                compound.derived = true;
+                if (compound.tag.empty() || position >= text.size() || text[position] != ')')
+                {
+                    LOG_ERROR("Invalid selector \"" + text + "\": expected :type(tag)");
+                    return false;
+                }
+                position++;
+            }
+            else
+            {
+                LOG_ERROR("Invalid selector \"" + text + "\": unexpected '" + c + "'");
+                return false;
+            }
+
+            empty = false;
+        }
+
+        if (!compound.tag.empty())
+        {
+            compound.type = document->element_types.getTypeOfElement(compound.tag);
+        }
+        compounds.push_back(compound);
+    }
+
+    if (compounds.size() == 0)
+    {
+        LOG_ERROR("Invalid selector \"" + text + "\": it's empty");
+        return false;
+    }
+
+    return true;
+}
+
+// Attributes loaded from files are numbers if they look like one, so the value is compared as whatever the attribute is
+bool attributeEquals(const AttrVariant& attribute, const std::string& value)
+{
+    try
+    {
+        if (std::holds_alternative<std::string>(attribute))
+        {
+            return std::get<std::string>(attribute) == value;
+        }
+        else if (std::holds_alternative<int>(attribute))
+        {
+            return std::get<int>(attribute) == std::stoi(value);
+        }
+        else if (std::holds_alternative<unsigned int>(attribute))
+        {
+            return std::get<unsigned int>(attribute) == std::stoul(value);
+        }
+        else if (std::holds_alternative<float>(attribute))
+        {
+            return std::get<float>(attribute) == std::stof(value);
+        }
+    }
+    catch (std::exception&)
+    {
+        // The value isn't a number, so it can't be equal
+    }
+
+    return false;
+}
+
+bool Selector::matchesCompound(Element* element, const Compound& compound) const
+{
+    if (compound.type != 0)
+    {
+        // Every element with the tag has its type as well, so this rules most things out
+        if (!element->type_container.isType(compound.type))
+        {
+            return false;
+        }
+        if (!compound.derived && element->getTagAtom() != compound.tag)
+        {
+            return false;
+        }
+    }
+
+    if (!compound.id.empty() && element->getIdAtom() != compound.id)
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < compound.classes.size(); i++)
+    {
+        if (!element->classList.has(compound.classes[i]))
+        {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < compound.attributes.size(); i++)
+    {
+        const Attribute& attribute = compound.attributes[i];
+        const AttrVariant* value = element->findAttribute(attribute.name);
+        if (value == nullptr)
+        {
+            return false;
+        }
+        if (attribute.has_value && !attributeEquals(*value, attribute.value))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Selector::matchesAncestors(Element* element, size_t index) const
+{
+    if (index == 0)
+    {
+        return true;
+    }
+
+    const Compound& previous = compounds[index - 1];
+
+    // Parents are owned by the tree, and anything taken out of it is kept until the end of the frame, so raw pointers are fine going up
+    Element* parent = element->getParent().get();
+    if (compounds[index].child)
+    {
+        return parent != nullptr && matchesCompound(parent, previous) && matchesAncestors(parent, index - 1);
+    }
+
+    while (parent != nullptr)
+    {
+        if (matchesCompound(parent, previous) && matchesAncestors(parent, index - 1))
+        {
+            return true;
+        }
+        parent = parent->getParent().get();
+    }
+
+    return false;
+}
+
+bool Selector::matches(Element* element) const
+{
+    if (!valid)
+    {
+        return false;
+    }
+
+    return matchesCompound(element, compounds.back()) && matchesAncestors(element, compounds.size() - 1);
+}
+
+size_t Selector::estimate(Document* document, const Compound& compound) const
+{
+    if (!compound.id.empty())
+    {
+        return 1;
+    }
+    if (compound.class_ids.size() > 0)
+    {
+        return document->getIndexedCount(true, compound.class_ids[0]);
+    }
+    if (compound.type != 0)
+    {
+        return document->getIndexedCount(false, compound.type);
+    }
+    return (size_t)-1;
+}
+
+void Selector::collect(Element* scope, size_t last, Memory::FrameVector<Element*>& output, bool first_only) const
+{
+    // An id is the narrowest place to get candidates from, then a class, then a tag
+    const Compound& compound = compounds[last];
+    Document* document = scope->document.get();
+
+    Memory::FrameVector<Element*> candidates;
+    Memory::FrameVector<std::shared_ptr<Element>> with_id;
+    bool indexed = false;
+
+    if (!compound.id.empty())
+    {
+        // Ids should be unique. If they aren't, walking the tree is the only way to get them in order
+        document->findElementsById(compound.id, scope, with_id);
+        if (with_id.size() <= 1)
+        {
+            for (size_t i = 0; i < with_id.size(); i++)
+            {
+                candidates.push_back(with_id[i].get());
+            }
+            indexed = true;
+        }
+    }
+    else if (compound.class_ids.size() > 0)
+    {
+        indexed = document->findIndexed(true, compound.class_ids[0], scope, candidates);
+    }
+    else if (compound.type != 0)
+    {
+        indexed = document->findIndexed(false, compound.type, scope, candidates);
+    }
+
+    if (indexed)
+    {
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (matchesCompound(candidates[i], compound) && matchesAncestors(candidates[i], last))
+            {
+                output.push_back(candidates[i]);
+                if (first_only)
+                {
+                    return;
+                }
+            }
+        }
+        return;
+    }
+
+    // Either there's nothing to look up, or the tree has changed since the index last knew where everything was
+    for (TreeIterator it(scope); !it.done(); it.next())
+    {
+        if (matchesCompound(it.get(), compound) && matchesAncestors(it.get(), last))
+        {
+            output.push_back(it.get());
+            if (first_only)
+            {
+                return;
+            }
+        }
+    }
+}
+
+void Selector::query(Element* scope, Memory::FrameVector<Element*>& output, bool first_only) const
+{
+    if (!valid)
+    {
+        return;
+    }
+
+    // Selectors are matched right to left, so normally the candidates are whatever matches the last compound.
+    // If only child combinators come after some compound that matches far fewer elements, like .enemy in .enemy > light3d,
+    // it's quicker to find those and look a few levels down from each one
+    Document* document = scope->document.get();
+    size_t last = compounds.size() - 1;
+    size_t anchor = last;
+    size_t best = estimate(document, compounds[last]);
+    for (size_t i = last; i > 0; i--)
+    {
+        if (!compounds[i].child)
+        {
+            break;
+        }
+
+        size_t count = estimate(document, compounds[i - 1]);
+        if (count < best / 4)
+        {
+            anchor = i - 1;
+            best = count;
+        }
+    }
+
+    if (anchor == last)
+    {
+        collect(scope, last, output, first_only);
+        return;
+    }
+
+    // Anchors above scope still count, so they're looked for everywhere. Parents are owned by the tree, so raw pointers are fine
+    Element* root = scope;
+    Element* parent = root->getParent().get();
+    while (parent != nullptr)
+    {
+        root = parent;
+        parent = root->getParent().get();
+    }
+
+    Memory::FrameVector<Element*> anchors;
+    if (matchesCompound(root, compounds[anchor]) && matchesAncestors(root, anchor))
+    {
+        anchors.push_back(root);
+    }
+    collect(root, anchor, anchors, false);
+
+    size_t levels = last - anchor;
+    size_t a = 0;
+    while (a < anchors.size())
+    {
+        Element* start = anchors[a];
+        a++;
+
+        if (start != scope && !start->isDescendantOf(scope))
+        {
+            if (scope->isDescendantOf(start))
+            {
+                // Scope is inside this anchor, so only part of what's below it can match. Go through all of scope instead
+                for (TreeIterator it(scope); !it.done(); it.next())
+                {
+                    if (matches(it.get()))
+                    {
+                        output.push_back(it.get());
+                        if (first_only)
+                        {
+                            return;
+                        }
+                    }
+                }
+                return;
+            }
+            continue;
+        }
+
+        // Anchors are in document order, so any inside this one come straight after it. Their matches would be mixed in with this one's,
+        // so in that case everything below this one is checked in order, which covers them as well
+        bool nested = false;
+        while (a < anchors.size() && anchors[a]->isDescendantOf(start))
+        {
+            nested = true;
+            a++;
+        }
+
+        for (TreeIterator it(start); !it.done(); it.next())
+        {
+            if (!nested && it.depth() < levels)
+            {
+                continue;
+            }
+            if (!nested)
+            {
+                it.skipSubtree();
+            }
+
+            if (matchesCompound(it.get(), compounds[last]) && matchesAncestors(it.get(), last))
+            {
+                output.push_back(it.get());
+                if (first_only)
+                {
+                    return;
+                }
+            }
+        }
+    }
+}
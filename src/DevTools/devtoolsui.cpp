@@ -27,6 +27,9 @@ DevTools::DevTools(std::shared_ptr<Document> document): DOM::Element(document),
 current_tab(0)
 {
     setTagName("devtools");
+
+    // Uses nuklear, and switches the renderer's camera
+    main_thread_render = true;
 }
 
 void DevTools::init()
@@ -65,7 +68,8 @@ void DevTools::render(float delta)
         nk_style_push_vec2(NKAPI::ctx, &NKAPI::ctx->style.window.spacing, nk_vec2(0,0));
         nk_style_push_float(NKAPI::ctx, &NKAPI::ctx->style.button.rounding, 0);
 
-        auto tabs = getElementsByTagName("devtoolstab", true);
+        Memory::FrameVector<std::shared_ptr<DOM::Element>> tabs;
+        getElementsByTagName("devtoolstab", true, tabs);
 
         nk_layout_row_begin(NKAPI::ctx, NK_STATIC, 30, tabs.size());
 
@@ -151,6 +155,7 @@ void DevTools::targetCamera(std::shared_ptr<Engine::E3D::Element3D> element)
 DevToolsTab::DevToolsTab(std::shared_ptr<Document> doc): DOM::Element(doc)
 {
     setTagName("devtoolstab");
+    main_thread_render = true;
 }
 
 void DevToolsTab::setTabName(std::string name)
@@ -213,12 +218,15 @@ int DevToolsTree::recursiveTreeRender(std::shared_ptr<DOM::Element> element, int
         }
     }
     id ++;
-    for (auto i = 0; i < element->getChildren().size(); i++)
+
+    // The buttons can change the tree, so this works on a copy instead of holding the lock with getChildRange
+    auto children = element->getChildren();
+    for (size_t i = 0; i < children.size(); i++)
     {
         if (worked)
         {
             
-            id = recursiveTreeRender(element->getChildren()[i], id);
+            id = recursiveTreeRender(children[i], id);
         }
         else
         {
@@ -3,9 +3,14 @@
 #include "Engine/Log.hpp"
 #include <exception>
 #include <stdexcept>
+#include <mutex>
+
+// Stops lines from different threads getting mixed together
+std::mutex log_lock;
 
 void __log(std::string text, termcolors::color color)
 {
+    std::lock_guard<std::mutex> guard(log_lock);
 #ifndef __EMSCRIPTEN__
     std::cout << termcolors::foreground_color(color) << text << std::endl << termcolors::reset;
 #else
@@ -15,6 +20,7 @@ void __log(std::string text, termcolors::color color)
 
 void __logFileLines(std::string prefix, std::string text, const char* file, int line, termcolors::color color)
 {
+    std::lock_guard<std::mutex> guard(log_lock);
 #ifndef __EMSCRIPTEN__
     std::cout << termcolors::foreground_color(color) 
             << "At " << file << ":" << line << std::endl
@@ -88,6 +88,7 @@ glm::mat4 OrbitCamera3D::_getViewMatrix()
 void OrbitCamera3D::setPosition(glm::vec3 pos)
 {
     transform_lock.lock();
+    saveStepTransform();
     transform = glm::make_mat4(aaa);
     transform_lock.unlock();
     translate(pos);
@@ -5,8 +5,11 @@
 #include "glm/ext/matrix_transform.hpp"
 #include "glm/fwd.hpp"
 #include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
 #include "glm/matrix.hpp"
 #include <glm/gtc/type_ptr.hpp>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/matrix_decompose.hpp>
 #include <memory>
 #include <stdexcept>
 #include <string>
@@ -15,9 +18,19 @@
 
 using namespace Engine::E3D;
 
+// Interned once so checking for it is just an integer lookup
+Engine::Atom element3d_tag("element3d");
+Engine::Atom transform_attribute("transform");
+
 Element3D::Element3D(std::shared_ptr<Document> parent_document): DOM::Element(parent_document),
 transform(),
-transform_lock()
+transform_lock(),
+transform_dirty(false),
+previous_transform(1.0f),
+transform_step(parent_document->getFrameNumber()),
+created_step(transform_step),
+render_transform(1.0f),
+render_global_transform(1.0f)
 {
     setTagName("element3d");
     float aaa[16] = {
@@ -46,66 +59,103 @@ void Element3D::devtoolsOrbit()
 
 glm::mat4 Element3D::getTransform() const
 {
+    std::lock_guard<std::mutex> guard(transform_lock);
     return transform;
 }
 
 glm::mat4 Element3D::getGlobalTransform() const
 {
+    std::lock_guard<std::mutex> guard(global_transform_lock);
     return global_transform;
 }
 
+glm::mat4 Element3D::getRenderTransform() const
+{
+    if (render_interpolated)
+    {
+        return render_transform;
+    }
+    return getTransform();
+}
+
+glm::mat4 Element3D::getRenderGlobalTransform() const
+{
+    if (render_interpolated)
+    {
+        return render_global_transform;
+    }
+    return getGlobalTransform();
+}
+
+void Element3D::saveStepTransform()
+{
+    // Only the first change in a step is kept, so previous_transform is where the step started
+    glm::uint64 step = document->getFrameNumber();
+    if (transform_step != step)
+    {
+        previous_transform = transform;
+        transform_step = step;
+    }
+}
+
 void Element3D::rotate(float angle, glm::vec3 axis)
 {
     transform_lock.lock();
+    saveStepTransform();
     transform = glm::rotate(transform, angle, axis);
     transform_lock.unlock();
-    callChildUpdate();
+    markTransformDirty();
 }
 
 void Element3D::rotateGlobal(float angle, glm::vec3 axis)
 {
     transform_lock.lock();
+    saveStepTransform();
     transform = glm::rotate(transform, angle, glm::vec3(glm::inverse(transform) * glm::vec4(axis, 0)));
     transform_lock.unlock();
+    markTransformDirty();
 }
 
 void Element3D::translate(glm::vec3 offset)
 {
     transform_lock.lock();
+    saveStepTransform();
     transform = glm::translate(transform, offset);
     transform_lock.unlock();
-    callChildUpdate();
+    markTransformDirty();
 }
 
 void Element3D::scale(glm::vec3 scaler)
 {
     transform_lock.lock();
+    saveStepTransform();
     transform = glm::scale(transform, scaler);
     transform_lock.unlock();
-    callChildUpdate();
+    markTransformDirty();
 }
 
 void Element3D::setTransform(glm::mat4 transfor)
 {
     transform_lock.lock();
+    saveStepTransform();
     transform = transfor;
     transform_lock.unlock();
-    callChildUpdate();
+    markTransformDirty();
 }
 
 void Element3D::updateGlobalTransform()
 {
-    // Find parent
+    // Find parent. This runs for every element that moves, so it just checks the parent rather than building a list with getParentsByTagName
     global_transform_lock.lock();
-    auto parents = getParentsByTagName("element3d", true);
-    if (parents.size() < 1)
+    auto direct_parent = getParent();
+    if (direct_parent == nullptr || !direct_parent->type_container.isType(document->element_types.getTypeOfElement(element3d_tag)))
     {
         global_transform_lock.unlock();
         // std::cout << tag_name << " could not get element3d parent" << std::endl;
         return;
     }
 
-    std::shared_ptr<Element3D> parent = std::dynamic_pointer_cast<Element3D>(parents[0]);
+    std::shared_ptr<Element3D> parent = std::dynamic_pointer_cast<Element3D>(direct_parent);
     if (parent == nullptr)
     {
         // My local is my global
@@ -132,6 +182,68 @@ void Element3D::callChildUpdate()
     }
 }
 
+// Blends between two transforms. Position and scale are mixed and rotation is slerped, so things don't shrink as they turn
+glm::mat4 interpolateTransform(const glm::mat4& from, const glm::mat4& to, float alpha)
+{
+    glm::vec3 from_scale, to_scale, from_position, to_position, skew;
+    glm::quat from_rotation, to_rotation;
+    glm::vec4 perspective;
+    if (!glm::decompose(from, from_scale, from_rotation, from_position, skew, perspective) || !glm::decompose(to, to_scale, to_rotation, to_position, skew, perspective))
+    {
+        return from + (to - from) * alpha;
+    }
+
+    glm::mat4 output = glm::translate(glm::mat4(1.0f), glm::mix(from_position, to_position, alpha));
+    output = output * glm::mat4_cast(glm::slerp(from_rotation, to_rotation, alpha));
+    return glm::scale(output, glm::mix(from_scale, to_scale, alpha));
+}
+
+void Element3D::updateRenderTransform(bool blending)
+{
+    std::shared_ptr<Element3D> parent;
+    auto direct_parent = getParent();
+    if (direct_parent != nullptr && direct_parent->type_container.isType(document->element_types.getTypeOfElement(element3d_tag)))
+    {
+        parent = std::dynamic_pointer_cast<Element3D>(direct_parent);
+    }
+
+    render_interpolated = blending || (parent != nullptr && parent->render_interpolated);
+    if (render_interpolated == false)
+    {
+        return;
+    }
+
+    render_transform = blending ? interpolateTransform(previous_transform, transform, document->getInterpolation()) : transform;
+    render_global_transform = parent != nullptr ? parent->getRenderGlobalTransform() * parent->getRenderTransform() : global_transform;
+}
+
+bool Element3D::propagateTransform(bool parent_changed)
+{
+    if (reparented.exchange(false))
+    {
+        parent_changed = true;
+    }
+
+    if (parent_changed)
+    {
+        updateGlobalTransform();
+    }
+
+    // With a fixed timestep, anything that moved in the last step is drawn between where it was and where it is, which changes every tick.
+    // Elements created in the last step haven't got anywhere to come from, so they're drawn where they are
+    bool blending = document->getFixedTimestep() > 0 && transform_step == document->getFrameNumber() && transform_step != created_step;
+    bool changed = transform_dirty.exchange(false) || parent_changed;
+    if (changed || blending || was_blending)
+    {
+        updateRenderTransform(blending);
+        changed = true;
+    }
+    was_blending = blending;
+
+    // Our children are relative to our local transform as well, so they need updating if that moved
+    return changed;
+}
+
 glm::mat4 stringToMatrix(std::string s)
 {
     std::string delimiter = " ";
@@ -162,22 +274,27 @@ glm::mat4 stringToMatrix(std::string s)
 // Saving and loading
 void Element3D::onLoad()
 {
-    if (hasAttribute("transform"))
+    // Scenes saved since matrices could be attributes have it as a mat4. Older XML has 16 numbers in a string
+    const DOM::AttrVariant* attribute = findAttribute(transform_attribute);
+    if (attribute == nullptr)
     {
-        try
-        {
-            transform_lock.lock();
-            transform = stringToMatrix(std::get<std::string>(getAttribute("transform")));
-            transform_lock.unlock();
-        }
-        catch (std::bad_variant_access e)
-        {
-            LOG_ERROR("Loading file: Element3D's attribute transform was not in the correct format");
-        }
+        LOG_WARN("Loading file: Element3D could not find transform attribute. Skipping");
+    }
+    else if (std::holds_alternative<glm::mat4>(*attribute))
+    {
+        transform_lock.lock();
+        transform = std::get<glm::mat4>(*attribute);
+        transform_lock.unlock();
+    }
+    else if (std::holds_alternative<std::string>(*attribute))
+    {
+        transform_lock.lock();
+        transform = stringToMatrix(std::get<std::string>(*attribute));
+        transform_lock.unlock();
     }
     else
     {
-        LOG_WARN("Loading file: Element3D could not find transform attribute. Skipping");
+        LOG_ERROR("Loading file: Element3D's attribute transform was not in the correct format");
     }
 
     // if (hasAttribute("global_transform"))
@@ -202,13 +319,7 @@ void Element3D::onLoad()
 // Saving
 void Element3D::onSave()
 {
-    transform_lock.lock();
-    setAttribute("transform", std::to_string(transform[0][0]) + " " + std::to_string(transform[0][1]) + " " + std::to_string(transform[0][2]) + " " + std::to_string(transform[0][3]) + " " + 
-                    std::to_string(transform[1][0]) + " " + std::to_string(transform[1][1]) + " " + std::to_string(transform[1][2]) + " " + std::to_string(transform[1][3]) + " " +
-                    std::to_string(transform[2][0]) + " " + std::to_string(transform[2][1]) + " " + std::to_string(transform[2][2]) + " " + std::to_string(transform[2][3]) + " " +
-                    std::to_string(transform[3][0]) + " " + std::to_string(transform[3][1]) + " " + std::to_string(transform[3][2]) + " " + std::to_string(transform[3][3]));
-
-    transform_lock.unlock();
+    setAttribute(transform_attribute, getTransform());
 
     // global_transform_lock.lock();
     // setAttribute("global_transform", std::to_string(global_transform[0][0]) + " " + std::to_string(global_transform[0][1]) + " " + std::to_string(global_transform[0][2]) + " " + std::to_string(global_transform[0][3]) + " " + 
@@ -219,26 +330,10 @@ void Element3D::onSave()
     // global_transform_lock.unlock();
 }
 
-void Element3D::appendChild(std::shared_ptr<DOM::Element> elem)
-{
-    if (elem->type_container.isType(document->element_types.getTypeOfElement("element3d")))
-    {
-        callChildUpdate();
-    }
-
-    DOM::Element::appendChild(elem);
-}
-
 void Element3D::onParentAdded()
 {
-    // if (getParent()->type_container.isType(document->element_types.getTypeOfElement("element3d")))
-    // {
-        // callChildUpdate();
-    // }
-    // else
-    // {
-    callChildUpdate();
-    // }
+    // Its global transform is worked out again in the transform phase, along with everything below it
+    reparented = true;
 }
 
 // ====================================================
@@ -251,7 +346,7 @@ CameraElement3D::CameraElement3D(std::shared_ptr<Document> document): Element3D:
 
 glm::mat4 CameraElement3D::_getViewMatrix()
 {
-    return glm::inverse(global_transform * transform);
+    return glm::inverse(getRenderGlobalTransform() * getRenderTransform());
 }
 
 // ================================================
@@ -275,11 +370,8 @@ void ManualMeshElement3D::setMesh(std::vector<glm::vec3> points, std::vector<glm
 
 void ManualMeshElement3D::render(float delta)
 {
-    global_transform_lock.lock();
-    transform_lock.lock();
+    // Nothing moves while render() is running, so the transforms don't need locking here
     // document->renderer->renderRenderObject(render_object, global_transform, transform);
-    global_transform_lock.unlock();
-    transform_lock.unlock();
 }
 
 // ==========================================================
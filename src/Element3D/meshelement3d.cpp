@@ -66,8 +66,7 @@ void MeshElement3D::_setResourceDry(std::shared_ptr<Models::MeshResource> res)
 
 void MeshElement3D::render(float delta)
 {
-    global_transform_lock.lock();
-    transform_lock.lock();
+    // Nothing moves while render() is running, so the transforms don't need locking here
 
     // Setting shader uniforms goes here
 
@@ -89,9 +88,10 @@ void MeshElement3D::render(float delta)
     // // render_object->shader_program->setUniform("material.two_sided", material.two_sided);
 
     // document->renderer->renderRenderObject(render_object, global_transform, transform);
-    document->renderer->addToRenderQueue(render_object, material, global_transform, transform, material->culling_mode);
-    global_transform_lock.unlock();
-    transform_lock.unlock();
+    // With a fixed timestep it's drawn partway between the last two steps
+    const glm::mat4& draw_global = render_interpolated ? render_global_transform : global_transform;
+    const glm::mat4& draw_local = render_interpolated ? render_transform : transform;
+    document->renderer->addToRenderQueue(render_object, material, draw_global, draw_local, material->culling_mode);
 }
 
 void MeshElement3D::onSave()
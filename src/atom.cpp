@@ -0,0 +1,76 @@
+#include "Engine/Atom.hpp"
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+using namespace Engine;
+
+// These are all function statics, since atoms can be made while other files' globals are being constructed
+std::shared_mutex& getAtomsLock()
+{
+    static std::shared_mutex lock;
+    return lock;
+}
+
+// Entries live in a deque so they never move once they're made, which is what lets atoms point straight at them
+std::deque<Atom::Entry>& getAtomEntries()
+{
+    static std::deque<Atom::Entry> entries = {Atom::Entry {"", 0}};
+    return entries;
+}
+
+std::unordered_map<std::string, const Atom::Entry*>& getAtomTable()
+{
+    static std::unordered_map<std::string, const Atom::Entry*> table = {{"", &getAtomEntries()[0]}};
+    return table;
+}
+
+const Atom::Entry* Atom::getEmptyEntry()
+{
+    static const Entry* empty = &getAtomEntries()[0];
+    return empty;
+}
+
+const Atom::Entry* Atom::intern(const std::string& text, bool create)
+{
+    if (text.empty())
+    {
+        return getEmptyEntry();
+    }
+
+    auto& table = getAtomTable();
+    {
+        std::shared_lock<std::shared_mutex> guard(getAtomsLock());
+        auto found = table.find(text);
+        if (found != table.end())
+        {
+            return found->second;
+        }
+    }
+
+    if (!create)
+    {
+        return getEmptyEntry();
+    }
+
+    std::unique_lock<std::shared_mutex> guard(getAtomsLock());
+
+    // Someone else might have made it while we didn't have the lock
+    auto found = table.find(text);
+    if (found != table.end())
+    {
+        return found->second;
+    }
+
+    auto& entries = getAtomEntries();
+    entries.push_back(Entry {text, (uint32_t)entries.size()});
+    table[text] = &entries.back();
+    return &entries.back();
+}
+
+size_t Atom::getAtomCount()
+{
+    std::shared_lock<std::shared_mutex> guard(getAtomsLock());
+    return getAtomEntries().size();
+}
@@ -0,0 +1,671 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Engine/Engine.hpp"
+#include "Engine/Renderer/Renderer.hpp"
+
+using namespace Engine;
+
+// Every heap allocation made while counting is on, from any thread. The replacement operator new below counts them
+std::atomic<bool> counting(false);
+std::atomic<unsigned long> allocations(0);
+
+void* countedAllocation(size_t size, size_t alignment)
+{
+    if (counting.load(std::memory_order_relaxed))
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (size == 0)
+    {
+        size = 1;
+    }
+    void* memory = alignment > alignof(std::max_align_t) ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size);
+    if (memory == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new(size_t size)
+{
+    return countedAllocation(size, 0);
+}
+
+void* operator new[](size_t size)
+{
+    return countedAllocation(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return countedAllocation(size, (size_t)alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return countedAllocation(size, (size_t)alignment);
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept
+{
+    std::free(memory);
+}
+
+// Milliseconds since start
+double elapsedMilliseconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+The thread pool as it was before the work-stealing deques: one std::queue of std::functions behind one lock, which every worker spins on.
+It's only kept here so the two can be compared
+*/
+class LockedQueuePool
+{
+    private:
+        std::vector<std::thread> pool;
+        std::queue<std::function<void()>> tasks;
+        std::mutex tasks_lock;
+        std::mutex free_lock;
+        int free_threads;
+        int total_threads;
+        std::atomic<bool> running;
+
+        void threadWorker()
+        {
+            std::function<void()> current_task;
+            bool has_task = false;
+
+            while (running)
+            {
+                tasks_lock.lock();
+                if (!tasks.empty())
+                {
+                    current_task = tasks.front();
+                    tasks.pop();
+                    has_task = true;
+                    free_lock.lock();
+                    free_threads -= 1;
+                    free_lock.unlock();
+                }
+                tasks_lock.unlock();
+
+                if (has_task)
+                {
+                    current_task();
+                    has_task = false;
+
+                    free_lock.lock();
+                    free_threads += 1;
+                    free_lock.unlock();
+                }
+            }
+        }
+
+    public:
+        LockedQueuePool(int threads): free_threads(threads), total_threads(threads), running(true)
+        {
+            for (int i = 0; i < threads; i++)
+            {
+                pool.push_back(std::thread(&LockedQueuePool::threadWorker, this));
+            }
+        }
+
+        ~LockedQueuePool()
+        {
+            running = false;
+            for (size_t i = 0; i < pool.size(); i++)
+            {
+                pool[i].join();
+            }
+        }
+
+        void addTask(std::function<void()> function)
+        {
+            tasks_lock.lock();
+            tasks.push(function);
+            tasks_lock.unlock();
+        }
+
+        void waitForCompletion()
+        {
+            bool end = false;
+            while (!end)
+            {
+                tasks_lock.lock();
+                free_lock.lock();
+                end = tasks.empty() && free_threads == total_threads;
+                free_lock.unlock();
+                tasks_lock.unlock();
+            }
+        }
+};
+
+// Queues 100k tiny tasks a frame, on the old locked queue and then on the current pool, and waits for each frame to finish
+void benchTasks(Threading::Settings settings)
+{
+    const int tasks_per_frame = 100000;
+    const int frames = 20;
+
+    Threading::startThreads(settings);
+    int threads = Threading::getThreadCount();
+    std::cout << "tasks: " << tasks_per_frame << " tasks a frame, " << frames << " frames, " << threads << " frame threads" << std::endl;
+
+    std::atomic<long> counter(0);
+    auto tiny = [&counter]() {
+        counter.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    // The old pool's main thread only waits, so it gets one more worker to make up for it
+    double old_ms;
+    {
+        LockedQueuePool old_pool(threads);
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++)
+        {
+            for (int i = 0; i < tasks_per_frame; i++)
+            {
+                old_pool.addTask(tiny);
+            }
+            old_pool.waitForCompletion();
+        }
+        old_ms = elapsedMilliseconds(start) / frames;
+    }
+    bool old_ok = counter == (long)tasks_per_frame * frames;
+
+    counter = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        for (int i = 0; i < tasks_per_frame; i++)
+        {
+            Threading::addTask(tiny);
+        }
+        Threading::waitForCompletion();
+    }
+    double new_ms = elapsedMilliseconds(start) / frames;
+    bool new_ok = counter == (long)tasks_per_frame * frames;
+
+    std::cout << "\tlocked queue:  " << old_ms << "ms a frame" << (old_ok ? "" : " (tasks went missing)") << std::endl;
+    std::cout << "\twork stealing: " << new_ms << "ms a frame" << (new_ok ? "" : " (tasks went missing)") << std::endl;
+    std::cout << "\t" << old_ms / new_ms << "x faster" << std::endl;
+
+    Threading::cleanup();
+}
+
+// An element that does nothing, but still has to be processed and rendered every frame
+class EmptyElement: public DOM::Element
+{
+    public:
+        EmptyElement(std::shared_ptr<Document> document): DOM::Element(document) {};
+
+        virtual void process(float delta) {};
+        virtual void render(float delta) {};
+};
+
+// Counts heap allocations once everything has warmed up: queueing small tasks, and ticking a 20k element document.
+// Both should be zero. Returns false if they aren't
+bool benchAllocations(Threading::Settings settings)
+{
+    const int elements = 20000;
+    const int warmup = 10;
+    const int frames = 100;
+
+    auto document = Document::createDocument(settings);
+    document->renderer = std::make_shared<Renderer::IRenderer>();
+
+    // 200 groups of 99, so there's some depth to walk
+    for (int i = 0; i < elements / 100; i++)
+    {
+        auto group = std::make_shared<EmptyElement>(document);
+        document->body->appendChild(group);
+        for (int j = 0; j < 99; j++)
+        {
+            group->appendChild(std::make_shared<EmptyElement>(document));
+        }
+    }
+
+    std::atomic<long> counter(0);
+    auto dispatch = [&counter]() {
+        // What Document::tick does with tasks: single tasks, a group, and a parallelFor
+        for (int i = 0; i < 10000; i++)
+        {
+            Threading::addTask([&counter]() {
+                counter.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+
+        Threading::TaskGroup group;
+        for (int i = 0; i < 1000; i++)
+        {
+            group.addTask([&counter]() {
+                counter.fetch_add(1, std::memory_order_relaxed);
+            });
+        }
+        group.wait();
+
+        Threading::parallelFor(0, 10000, [&counter](size_t i) {
+            counter.fetch_add(1, std::memory_order_relaxed);
+        });
+        Threading::waitForCompletion();
+        Memory::resetFrameArenas();
+    };
+
+    for (int frame = 0; frame < warmup; frame++)
+    {
+        dispatch();
+        document->tick(0.016f);
+    }
+
+    allocations = 0;
+    counting = true;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        dispatch();
+    }
+    counting = false;
+    unsigned long task_allocations = allocations;
+
+    allocations = 0;
+    counting = true;
+    for (int frame = 0; frame < frames; frame++)
+    {
+        document->tick(0.016f);
+    }
+    document->sync();
+    counting = false;
+    unsigned long tick_allocations = allocations;
+
+    std::cout << "alloc: heap allocations over " << frames << " frames, after " << warmup << " to warm up" << std::endl;
+    std::cout << "\tqueueing 21k small tasks a frame: " << task_allocations << std::endl;
+    std::cout << "\tticking " << elements << " elements: " << tick_allocations << std::endl;
+
+    document->destroy();
+    Threading::cleanup();
+    return task_allocations == 0 && tick_allocations == 0;
+}
+
+// Keeps the CPU busy for a while, like a process() that does some real work
+void spin(double microseconds)
+{
+    auto start = std::chrono::steady_clock::now();
+    while (std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() < microseconds)
+    {
+    }
+}
+
+class BusyElement: public DOM::Element
+{
+    public:
+        BusyElement(std::shared_ptr<Document> document): DOM::Element(document) {};
+
+        virtual void process(float delta)
+        {
+            spin(2);
+        }
+};
+
+// Stands in for Amber. Submitting the frame mostly waits on the driver, so it sleeps rather than spins
+class SleepingRenderer: public Renderer::IRenderer
+{
+    public:
+        double draw_ms = 0;
+
+        virtual void drawFrame(float delta)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(draw_ms));
+        }
+};
+
+// The same frame at every latency: 2000 elements that each process for 2us, 4ms of drawing, and 2ms of presenting after tick (nuklear and the buffer swap)
+void benchLatency(Threading::Settings settings)
+{
+    const int elements = 2000;
+    const int frames = 100;
+    const double present_ms = 2;
+
+    auto document = Document::createDocument(settings);
+    auto renderer = std::make_shared<SleepingRenderer>();
+    renderer->draw_ms = 4;
+    document->renderer = renderer;
+
+    for (int i = 0; i < elements; i++)
+    {
+        document->body->appendChild(std::make_shared<BusyElement>(document));
+    }
+
+    std::cout << "latency: " << elements << " elements processing for 2us each, " << renderer->draw_ms << "ms drawing, " << present_ms << "ms presenting" << std::endl;
+    for (int latency = 0; latency <= 2; latency++)
+    {
+        document->setFrameLatency(latency);
+
+        // Let it settle into the new latency first
+        for (int frame = 0; frame < 5; frame++)
+        {
+            document->tick(0.016f);
+        }
+
+        TickStats totals;
+        auto start = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < frames; frame++)
+        {
+            document->tick(0.016f);
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(present_ms));
+
+            TickStats stats = document->getTickStats();
+            totals.process += stats.process;
+            totals.draw += stats.draw;
+        }
+        double frame_ms = elapsedMilliseconds(start) / frames;
+
+        std::cout << "\tlatency " << latency << ": " << frame_ms << "ms a frame (main thread waiting on process " << totals.process / frames
+                  << "ms, drawing " << totals.draw / frames << "ms)" << std::endl;
+    }
+
+    document->sync();
+    document->destroy();
+    Threading::cleanup();
+}
+
+// Document::tick as it was before the flat arrays: a recursive walk that copies every child vector and queues a std::function per element
+void recursiveProcess(float delta, std::shared_ptr<DOM::Element> element)
+{
+    if (element->getProcess() == false)
+    {
+        return;
+    }
+
+    Threading::addTask(std::function<void()>(std::bind(&DOM::Element::process, element, delta)));
+    for (size_t i = 0; i < element->getChildren().size(); i++)
+    {
+        recursiveProcess(delta, element->getChildren()[i]);
+    }
+}
+
+void recursiveRender(float delta, std::shared_ptr<DOM::Element> element)
+{
+    if (element->getVisible() == false)
+    {
+        return;
+    }
+
+    Threading::addTask(std::function<void()>(std::bind(&DOM::Element::render, element, delta)));
+    for (size_t i = 0; i < element->getChildren().size(); i++)
+    {
+        recursiveRender(delta, element->getChildren()[i]);
+    }
+}
+
+// Ticks 100k elements in 1000 subtrees, then again with a 50k deep chain added. The recursive walk is timed on the first tree only, since the chain overflows its stack
+void benchTraversal(Threading::Settings settings)
+{
+    const int frames = 20;
+
+    auto document = Document::createDocument(settings);
+    document->renderer = std::make_shared<Renderer::IRenderer>();
+    document->setFrameLatency(0);
+
+    auto root = std::make_shared<EmptyElement>(document);
+    document->body->appendChild(root);
+    for (int i = 0; i < 1000; i++)
+    {
+        // Each subtree is 10 levels of 10
+        std::shared_ptr<DOM::Element> parent = std::make_shared<EmptyElement>(document);
+        root->appendChild(parent);
+        for (int j = 0; j < 99; j++)
+        {
+            auto child = std::make_shared<EmptyElement>(document);
+            parent->appendChild(child);
+            if (j % 10 == 9)
+            {
+                parent = child;
+            }
+        }
+    }
+
+    // The first tick inits everything
+    document->tick(0.016f);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        document->tick(0.016f);
+    }
+    double flat_ms = elapsedMilliseconds(start) / frames;
+
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        recursiveProcess(0.016f, root);
+        Threading::waitForCompletion();
+        recursiveRender(0.016f, root);
+        Threading::waitForCompletion();
+    }
+    double recursive_ms = elapsedMilliseconds(start) / frames;
+
+    std::shared_ptr<DOM::Element> parent = root;
+    for (int i = 0; i < 50000; i++)
+    {
+        auto child = std::make_shared<EmptyElement>(document);
+        parent->appendChild(child);
+        parent = child;
+    }
+    document->tick(0.016f);
+
+    start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        document->tick(0.016f);
+    }
+    double deep_ms = elapsedMilliseconds(start) / frames;
+
+    std::cout << "traversal: one frame of process and render" << std::endl;
+    std::cout << "\t100k elements, recursive walk: " << recursive_ms << "ms" << std::endl;
+    std::cout << "\t100k elements, Document::tick: " << flat_ms << "ms" << std::endl;
+    std::cout << "\t150k elements with a 50k deep chain, Document::tick: " << deep_ms << "ms" << std::endl;
+
+    document->destroy();
+    Threading::cleanup();
+}
+
+// An element that keeps count of how many of it are alive
+class CountedElement: public EmptyElement
+{
+    public:
+        static std::atomic<int> live;
+
+        CountedElement(std::shared_ptr<Document> document): EmptyElement(document)
+        {
+            live++;
+        };
+
+        virtual ~CountedElement()
+        {
+            live--;
+        };
+};
+
+std::atomic<int> CountedElement::live {0};
+
+// Resident memory in KB, or -1 where /proc isn't available
+long residentKilobytes()
+{
+#ifdef __linux__
+    std::ifstream statm("/proc/self/statm");
+    long size = 0;
+    long resident = 0;
+    if (statm >> size >> resident)
+    {
+        return resident * 4;
+    }
+#endif
+    return -1;
+}
+
+// Loads and destroys an 11111 element scene 20 times. Every element should be freed, and memory shouldn't grow after the first cycle. Returns false if anything is left alive
+bool benchLoad(Threading::Settings settings)
+{
+    const int cycles = 20;
+
+    auto document = Document::createDocument(settings);
+    document->renderer = std::make_shared<Renderer::IRenderer>();
+    DOM::ElementClassFactory<CountedElement> factory;
+
+    std::cout << "load: " << cycles << " cycles of loading and destroying 11111 elements" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int cycle = 0; cycle < cycles; cycle++)
+    {
+        // 5 levels, 10 children each
+        auto root = factory.getNewInstance(document);
+        std::vector<std::shared_ptr<DOM::Element>> level {root};
+        for (int depth = 0; depth < 4; depth++)
+        {
+            std::vector<std::shared_ptr<DOM::Element>> next;
+            for (auto& parent: level)
+            {
+                for (int i = 0; i < 10; i++)
+                {
+                    auto child = factory.getNewInstance(document);
+                    parent->appendChild(child);
+                    next.push_back(child);
+                }
+            }
+            level.swap(next);
+        }
+        level.clear();
+
+        document->body->appendChild(root);
+        document->tick(0.016f);
+
+        root->destroy();
+        root.reset();
+        document->tick(0.016f);
+
+        if (cycle == 0 || cycle % 5 == 4)
+        {
+            std::cout << "\tcycle " << cycle + 1 << ": " << CountedElement::live << " elements alive, " << residentKilobytes() << "KB resident" << std::endl;
+        }
+    }
+    double ms = elapsedMilliseconds(start);
+
+    auto pool_stats = Memory::getPoolStats();
+    std::cout << "\ttotal " << ms << "ms, pools: " << pool_stats.pools << ", " << pool_stats.bytes_used / 1024 << "KB used, " << pool_stats.bytes_reserved / 1024 << "KB reserved" << std::endl;
+
+    bool freed = CountedElement::live == 0;
+
+    document->destroy();
+    Threading::cleanup();
+
+    return freed;
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string command = argc < 2 ? "all" : std::string(argv[1]);
+
+    // Threads default to one per core, like the engine
+    Threading::Settings settings;
+    if (argc >= 3)
+    {
+        settings.mode = Threading::Mode::Fixed;
+        settings.threads = std::stoi(argv[2]);
+    }
+
+    if (command == "help" || command == "-h" || command == "--help")
+    {
+        std::cout << "Engine benchmarks:" << std::endl;
+        std::cout << "Usage: EngineBench [benchmark] [threads]" << std::endl;
+        std::cout << "\tall - Run every benchmark (the default)" << std::endl;
+        std::cout << "\ttasks - 100k tiny tasks a frame on the old locked queue and on the work-stealing pool" << std::endl;
+        std::cout << "\talloc - Counts heap allocations in steady state frames. Fails if there are any" << std::endl;
+        std::cout << "\tlatency - Frame time with 0, 1 and 2 frames of latency" << std::endl;
+        std::cout << "\ttraversal - Ticking 100k and 150k element trees, against the old recursive walk" << std::endl;
+        std::cout << "\tload - Loading and destroying an 11111 element scene 20 times" << std::endl;
+        return 0;
+    }
+
+    bool all = command == "all";
+    bool ran = false;
+    bool passed = true;
+    if (all || command == "tasks")
+    {
+        benchTasks(settings);
+        ran = true;
+    }
+    if (all || command == "alloc")
+    {
+        passed = benchAllocations(settings) && passed;
+        ran = true;
+    }
+    if (all || command == "latency")
+    {
+        benchLatency(settings);
+        ran = true;
+    }
+    if (all || command == "traversal")
+    {
+        benchTraversal(settings);
+        ran = true;
+    }
+    if (all || command == "load")
+    {
+        passed = benchLoad(settings) && passed;
+        ran = true;
+    }
+
+    if (!ran)
+    {
+        std::cout << "Invalid benchmark \"" + command + "\"" << std::endl;
+        return 1;
+    }
+    return passed ? 0 : 1;
+}
@@ -4,6 +4,11 @@
 #include "Engine/DevTools.hpp"
 #include "Engine/Log.hpp"
 #include "Engine/Res.hpp"
+#include "Engine/Scene.hpp"
+#include "Engine/Selector.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <exception>
 #include <memory>
 #include <string>
@@ -14,7 +19,8 @@ using namespace tinyxml2;
 
 
 Engine::Document::Document()
-:element_types()
+:schedule_wheel(256),
+element_types()
 {
 
 #ifndef ENGINE_NO_THREADING
@@ -61,17 +67,6 @@ void Engine::Document::addElement(std::string name, std::shared_ptr<DOM::Element
     element_classes[name] = type;
 }
 
-bool is_int(const std::string & s)
-{
-
-    return (s.find_first_not_of( "-0123456789" ) == std::string::npos);
-}
-
-bool is_float(const std::string & s)
-{
-    return (s.find_first_not_of( ".0123456789" ) == std::string::npos);
-}
-
 std::shared_ptr<Engine::DOM::Element> Engine::Document::xmlElementToElement(XMLElement* node)
 {
     std::shared_ptr<DOM::Element> element;
@@ -94,26 +89,7 @@ std::shared_ptr<Engine::DOM::Element> Engine::Document::xmlElementToElement(XMLE
     // Attributes aka the strange bit
     for (const XMLAttribute* child = node->FirstAttribute(); child != nullptr; child = child->Next())
     {
-        DOM::AttrVariant value = "";
-        std::string temp_v = child->Value();
-
-        // Int
-        if (is_int(temp_v)) {
-            value = std::stoi(temp_v);
-        }
-
-        // Float
-        else if (is_float(temp_v)) {
-            value = std::stof(temp_v);
-        }
-
-        // String
-        else
-        {
-            value = std::string(child->Value());
-        }
-
-        element->setAttribute(child->Name(), value);
+        element->setAttribute(child->Name(), Scene::parseAttribute(child->Value()));
     }
 
     if (element->hasAttribute("id"))
@@ -165,10 +141,133 @@ std::shared_ptr<Engine::DOM::Element> Engine::Document::xmlElementToElement(XMLE
 
 }
 
+std::shared_ptr<Engine::DOM::Element> Engine::Document::sceneToElement(const std::string& data)
+{
+    Scene::Reader reader(data);
+    if (!reader.isValid())
+    {
+        return nullptr;
+    }
+
+    // Names come up over and over, so each one is only interned, and each tag's class only looked up, the first time it's used
+    const std::vector<std::string>& strings = reader.getStrings();
+    std::vector<Atom> atoms(strings.size());
+    auto getAtom = [&atoms, &strings](glm::uint32 index) {
+        if (atoms[index].empty())
+        {
+            atoms[index] = Atom(strings[index]);
+        }
+        return atoms[index];
+    };
+
+    std::unordered_map<glm::uint32, DOM::ElementClass*> tag_classes;
+    auto getClass = [this, &tag_classes, &strings](glm::uint32 tag) {
+        auto found = tag_classes.find(tag);
+        if (found != tag_classes.end())
+        {
+            return found->second;
+        }
+
+        DOM::ElementClass* element_class = nullptr;
+        auto registered = element_classes.find(strings[tag]);
+        if (registered != element_classes.end())
+        {
+            element_class = registered->second.get();
+        }
+        else
+        {
+            LOG_WARN("Could not find element " + strings[tag] + ". Using base Element instead");
+        }
+        tag_classes[tag] = element_class;
+        return element_class;
+    };
+
+    std::shared_ptr<DOM::Element> base;
+
+    // The elements still waiting for children, and how many they're waiting for
+    std::vector<std::pair<std::shared_ptr<DOM::Element>, glm::uint32>> open;
+
+    Scene::ElementRecord record;
+    for (glm::uint32 i = 0; i < reader.getElementCount(); i++)
+    {
+        if (!reader.readElement(record) || (base != nullptr && open.empty()))
+        {
+            LOG_ERROR("During file load: the binary scene is broken. Returning nullptr");
+            return nullptr;
+        }
+
+        std::shared_ptr<DOM::Element> element;
+        DOM::ElementClass* element_class = getClass(record.tag);
+        if (element_class != nullptr)
+        {
+            element = element_class->getNewInstance(shared_from_this());
+        }
+        else
+        {
+            element = std::make_shared<DOM::Element>(shared_from_this());
+            element->setTagName(getAtom(record.tag));
+        }
+
+        for (size_t j = 0; j < record.attributes.size(); j++)
+        {
+            element->setAttribute(getAtom(record.attributes[j].first), std::move(record.attributes[j].second));
+        }
+
+        if (record.id != Scene::no_string)
+        {
+            element->setId(strings[record.id]);
+        }
+
+        for (size_t j = 0; j < record.classes.size(); j++)
+        {
+            element->classList.add(getAtom(record.classes[j]));
+        }
+
+        element->onLoad();
+
+        if (base == nullptr)
+        {
+            base = element;
+        }
+        else
+        {
+            open.back().first->appendChild(element);
+            open.back().second--;
+        }
+
+        if (record.child_count > 0)
+        {
+            open.emplace_back(element, record.child_count);
+        }
+        while (!open.empty() && open.back().second == 0)
+        {
+            open.pop_back();
+        }
+    }
+
+    if (base == nullptr || !open.empty())
+    {
+        LOG_ERROR("During file load: the binary scene is truncated. Returning nullptr");
+        return nullptr;
+    }
+
+    return base;
+}
+
 std::shared_ptr<Engine::DOM::Element> Engine::Document::loadFromFile(std::string name)
 {
-    std::string text = Engine::Res::ResourceManager::load<Engine::Res::TextResource>(name)->getText();
-    
+    auto resource = Engine::Res::ResourceManager::load<Engine::Res::TextResource>(name);
+    if (resource == nullptr)
+    {
+        return nullptr;
+    }
+    std::string text = resource->getText();
+
+    if (Scene::isBinaryScene(text))
+    {
+        return sceneToElement(text);
+    }
+
     // Create the document & load the xml
     tinyxml2::XMLDocument doc;
     doc.Parse(text.c_str());
@@ -184,61 +283,1060 @@ std::shared_ptr<Engine::DOM::Element> Engine::Document::loadFromFile(std::string
     // doc should be freed automatically
 }
 
+// Milliseconds since start
+double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
 void Engine::Document::tick(float delta)
 {
-    executeElement(delta, base);
-    renderElement(delta, base);
+    // The frame runs in phases, and each phase has to finish before the next one starts.
+    // That way nothing is still moving while it's being rendered. The only thing that overlaps is the renderer drawing the last frame's queue
+    auto tick_start = std::chrono::steady_clock::now();
+    int latency = frame_latency;
+
+    float step_delta = delta;
+    int steps = takeSteps(delta, step_delta);
+    tick_stats.steps = steps + (processed_ahead ? 1 : 0);
+
+    if (latency == 0)
+    {
+        // In case the latency was just lowered from 2
+        sync();
+        processSteps(steps, step_delta);
+        processed_ahead = false;
+        tick_stats.process = millisecondsSince(tick_start);
+        tick_stats.draw = 0;
+    }
+    else
+    {
+        // If it was started last tick, this frame has already been processed
+        // With a fixed timestep the step run ahead has already been taken off, so this only runs any that are still due
+        Engine::Threading::TaskGroup process_group;
+        if (steps > 0)
+        {
+            process_group.addTask([this, steps, step_delta]() {
+                processSteps(steps, step_delta);
+            });
+        }
+        processed_ahead = false;
+
+        // The queue being drawn was finished last tick, so it can be drawn while the workers process this frame
+        auto draw_start = std::chrono::steady_clock::now();
+        renderer->drawFrame(delta);
+        tick_stats.draw = millisecondsSince(draw_start);
+
+        auto wait_start = std::chrono::steady_clock::now();
+        process_group.wait();
+        sync();
+        tick_stats.process = millisecondsSince(wait_start);
+    }
+
+    // Inits go first, so anything they move or add is propagated and delivered this frame
+    initElements();
 
-    renderer->drawFrame(delta);
+    auto transform_start = std::chrono::steady_clock::now();
+    deliverMutations();
+    transformPhase();
+    tick_stats.transform = millisecondsSince(transform_start);
 
+    auto render_start = std::chrono::steady_clock::now();
+    renderPhase(delta);
+    renderer->finishQueue();
+    tick_stats.render = millisecondsSince(render_start);
+
+    if (latency == 0)
+    {
+        auto draw_start = std::chrono::steady_clock::now();
+        renderer->drawFrame(delta);
+        tick_stats.draw = millisecondsSince(draw_start);
+    }
+
+    // Anything elements added themselves
     Engine::Threading::waitForCompletion();
+
+    // Nothing can still be using these now
+    released_lock.lock();
+    released.clear();
+    released_lock.unlock();
+
+    Memory::resetFrameArenas();
+
+    // Get going on the next frame while the renderer presents this one. Until the next frame's delta is known, this one's is used.
+    // With a fixed timestep that's one step, if the next tick looks like it'll need one, paid for out of the time it adds
+    float ahead_delta = delta;
+    bool run_ahead = latency == 2;
+    if (run_ahead && fixed_step > 0)
+    {
+        ahead_delta = fixed_step;
+        run_ahead = step_time + delta >= fixed_step;
+    }
+
+    if (run_ahead)
+    {
+        if (fixed_step > 0)
+        {
+            step_time -= fixed_step;
+        }
+
+        ahead_running = true;
+        processed_ahead = true;
+        ahead_group.addTask([this, ahead_delta]() {
+            processPhase(ahead_delta);
+        });
+    }
+
+    tick_stats.total = millisecondsSince(tick_start);
+}
+
+int Engine::Document::takeSteps(float delta, float& step_delta)
+{
+    if (fixed_step <= 0)
+    {
+        // One process() a tick, unless it was already run ahead
+        step_delta = delta;
+        interpolation = 1;
+        return processed_ahead ? 0 : 1;
+    }
+
+    step_delta = fixed_step;
+    step_time += delta;
+
+    int steps = 0;
+    if (step_time >= fixed_step)
+    {
+        steps = (int)std::floor(step_time / fixed_step);
+    }
+
+    if (steps > max_steps)
+    {
+        // Too far behind to catch up. Trying to would make this tick even slower, and the next one would be further behind still
+        steps = max_steps;
+        step_time = std::fmod(step_time, (double)fixed_step);
+    }
+    else
+    {
+        step_time -= steps * (double)fixed_step;
+    }
+
+    // A step run ahead puts the simulation in front of real time, so step_time can be below 0. That's drawn as the last step
+    interpolation = glm::clamp((float)(step_time / fixed_step), 0.0f, 1.0f);
+    return steps;
+}
+
+void Engine::Document::processSteps(int steps, float delta)
+{
+    for (int i = 0; i < steps; i++)
+    {
+        processPhase(delta);
+    }
+}
+
+void Engine::Document::processPhase(float delta)
+{
+    updateFlatTree();
+
+    frame_number++;
+    clock += delta;
+    last_delta = delta;
+
+    // Anything whose wake up timer is up has to be woken before the awake list is looked at
+    scheduled_list.clear();
+    runSchedule(scheduled_list);
+
+    if (schedule_dirty.exchange(false) || awake_version != flat_version)
+    {
+        rebuildAwakeList();
+    }
+
+    // The lists keep their memory between frames, so this doesn't allocate once they're big enough
+    process_list.assign(awake_list.begin(), awake_list.end());
+    process_deltas.assign(awake_list.size(), delta);
+
+    // Scheduled elements only run if they're still in the tree, since the tree is what keeps them alive until the end of the frame
+    for (size_t i = 0; i < scheduled_list.size(); i++)
+    {
+        DOM::Element* element = scheduled_list[i];
+        glm::uint32 index = element->flat_index;
+        if (index < flat_elements.size() && flat_elements[index] == element && flat_active[index] && element->inited)
+        {
+            process_list.push_back(element);
+            process_deltas.push_back(scheduled_deltas[i]);
+        }
+    }
+
+    if (batched_process)
+    {
+        Engine::Threading::parallelFor(0, process_list.size(), [this](size_t i) {
+            process_list[i]->process(process_deltas[i]);
+        });
+    }
+    else
+    {
+        Engine::Threading::TaskGroup process_group;
+        for (size_t i = 0; i < process_list.size(); i++)
+        {
+            DOM::Element* target = process_list[i];
+            float target_delta = process_deltas[i];
+            process_group.addTask([target, target_delta]() {
+                target->process(target_delta);
+            });
+        }
+        process_group.wait();
+    }
+}
+
+void Engine::Document::rebuildAwakeList()
+{
+    std::lock_guard<std::mutex> guard(schedule_lock);
+
+    awake_list.clear();
+    flat_active.assign(flat_elements.size(), false);
+    size_t i = 0;
+    while (i < flat_elements.size())
+    {
+        if (flat_process[i] == false)
+        {
+            i = flat_subtree_end[i];
+            continue;
+        }
+
+        flat_active[i] = true;
+        DOM::Element* element = flat_elements[i];
+        if (element->inited && !element->sleeping && element->process_interval <= 1 && element->process_period <= 0)
+        {
+            awake_list.push_back(element);
+        }
+        i++;
+    }
+
+    awake_version = flat_version;
+}
+
+// How many frames until `seconds` have passed, going by the last frame's length. Always at least 1
+glm::uint64 framesUntil(double seconds, float frame_length)
+{
+    if (frame_length <= 0 || seconds <= frame_length)
+    {
+        return 1;
+    }
+    return (glm::uint64)std::llround(seconds / frame_length);
+}
+
+void Engine::Document::wheelInsert(DOM::Element* element, glm::uint64 frame)
+{
+    wheelRemove(element);
+
+    auto& slot = schedule_wheel[frame % schedule_wheel.size()];
+    element->wheel_slot = (glm::int32)(frame % schedule_wheel.size());
+    element->wheel_position = (glm::uint32)slot.size();
+    slot.push_back(WheelEntry {element, frame});
+}
+
+void Engine::Document::wheelRemove(DOM::Element* element)
+{
+    if (element->wheel_slot < 0)
+    {
+        return;
+    }
+
+    auto& slot = schedule_wheel[element->wheel_slot];
+    glm::uint32 position = element->wheel_position;
+    if (position != slot.size() - 1)
+    {
+        slot[position] = slot.back();
+        slot[position].element->wheel_position = position;
+    }
+    slot.pop_back();
+    element->wheel_slot = -1;
+}
+
+void Engine::Document::reschedule(DOM::Element* element)
+{
+    wheelRemove(element);
+
+    if (element->sleeping)
+    {
+        if (element->wake_time >= 0)
+        {
+            wheelInsert(element, frame_number + framesUntil(element->wake_time - clock, last_delta));
+        }
+    }
+    else if (element->process_period > 0)
+    {
+        wheelInsert(element, frame_number + framesUntil(element->process_period - (clock - element->last_process_time), last_delta));
+    }
+    else if (element->process_interval > 1)
+    {
+        wheelInsert(element, frame_number + element->process_interval);
+    }
+}
+
+void Engine::Document::runSchedule(std::vector<DOM::Element*>& due)
+{
+    std::lock_guard<std::mutex> guard(schedule_lock);
+
+    scheduled_deltas.clear();
+    auto& slot = schedule_wheel[frame_number % schedule_wheel.size()];
+    size_t i = 0;
+    while (i < slot.size())
+    {
+        // Anything due on a later lap of the wheel stays where it is
+        if (slot[i].frame > frame_number)
+        {
+            i++;
+            continue;
+        }
+
+        // Taking it out moves the last entry into i, so i isn't moved on
+        DOM::Element* element = slot[i].element;
+        wheelRemove(element);
+
+        // Times are only guessed in frames, so anything within half a frame of being due is due
+        double slack = last_delta * 0.5;
+        if (element->sleeping)
+        {
+            if (element->wake_time <= clock + slack)
+            {
+                element->sleeping = false;
+                element->wake_time = -1;
+                element->last_process_time = clock;
+                schedule_dirty = true;
+            }
+            reschedule(element);
+            continue;
+        }
+
+        double elapsed = clock - element->last_process_time;
+        if (element->process_period > 0 && elapsed < element->process_period - slack)
+        {
+            reschedule(element);
+            continue;
+        }
+
+        due.push_back(element);
+        scheduled_deltas.push_back((float)elapsed);
+        element->last_process_time = clock;
+        reschedule(element);
+    }
+}
+
+void Engine::Document::setSleeping(DOM::Element* element, bool sleep, float wake_seconds)
+{
+    std::lock_guard<std::mutex> guard(schedule_lock);
+
+    // Waking something that's awake, or putting something to sleep for good twice, doesn't change anything
+    if (element->sleeping == sleep && !(sleep && wake_seconds >= 0))
+    {
+        return;
+    }
+
+    element->sleeping = sleep;
+    element->wake_time = (sleep && wake_seconds >= 0) ? clock + wake_seconds : -1;
+
+    // It shouldn't get the time it spent asleep as its next delta
+    element->last_process_time = clock;
+    reschedule(element);
+    schedule_dirty = true;
+}
+
+void Engine::Document::setProcessSchedule(DOM::Element* element, unsigned int interval, float period)
+{
+    std::lock_guard<std::mutex> guard(schedule_lock);
+    element->process_interval = interval < 1 ? 1 : interval;
+    element->process_period = period < 0 ? 0 : period;
+    element->last_process_time = clock;
+    reschedule(element);
+    schedule_dirty = true;
+}
+
+void Engine::Document::unschedule(DOM::Element* element)
+{
+    std::lock_guard<std::mutex> guard(schedule_lock);
+    wheelRemove(element);
+}
+
+void Engine::Document::sync()
+{
+    if (ahead_running)
+    {
+        ahead_group.wait();
+        ahead_running = false;
+    }
+}
+
+void Engine::Document::setFrameLatency(int latency)
+{
+    if (latency < 0)
+    {
+        latency = 0;
+    }
+    else if (latency > 2)
+    {
+        latency = 2;
+    }
+    frame_latency = latency;
+}
+
+void Engine::Document::setFixedTimestep(float seconds)
+{
+    if (seconds < 0)
+    {
+        seconds = 0;
+    }
+    fixed_step = seconds;
+    step_time = 0;
+    interpolation = 1;
+}
+
+void Engine::Document::setMaxSteps(int steps)
+{
+    if (steps < 1)
+    {
+        steps = 1;
+    }
+    max_steps = steps;
+}
+
+void Engine::Document::addToIndex(bool by_class, int id, const DOM::Element* element)
+{
+    std::lock_guard<std::mutex> guard(index_lock);
+    auto& index = by_class ? class_index : type_index;
+    if ((size_t)id >= index.size())
+    {
+        index.resize(id + 1);
+    }
+    index[id].insert(element);
+}
+
+void Engine::Document::removeFromIndex(bool by_class, int id, const DOM::Element* element)
+{
+    std::lock_guard<std::mutex> guard(index_lock);
+    auto& index = by_class ? class_index : type_index;
+    if ((size_t)id < index.size())
+    {
+        index[id].erase(element);
+    }
+}
+
+size_t Engine::Document::getIndexedCount(bool by_class, int id)
+{
+    std::lock_guard<std::mutex> guard(index_lock);
+    auto& index = by_class ? class_index : type_index;
+    if ((size_t)id >= index.size())
+    {
+        return 0;
+    }
+    return index[id].size();
 }
 
-void Engine::Document::renderElement(float delta, std::shared_ptr<DOM::Element> element)
+bool Engine::Document::findIndexed(bool by_class, int id, DOM::Element* scope, Memory::FrameVector<DOM::Element*>& output)
 {
-    if (element->inited == false)
+    std::shared_lock<std::shared_mutex> flat_guard(flat_lock);
+    if (tree_dirty)
+    {
+        return false;
+    }
+
+    // Anything that isn't in the flat tree has to be walked
+    size_t position = scope->flat_index;
+    if (position >= flat_elements.size() || flat_elements[position] != scope)
+    {
+        return false;
+    }
+    size_t begin = position + 1;
+    size_t end = flat_subtree_end[position];
+
+    std::lock_guard<std::mutex> guard(index_lock);
+    auto& index = by_class ? class_index : type_index;
+    if ((size_t)id >= index.size())
     {
-        element->init();
-        element->inited = true;
+        return true;
     }
+    auto& members = index[id];
+
+    // Whichever's smaller out of the subtree and everything with the type gets searched.
+    // Elements take themselves out of the index before they're gone, so anything in it can still be looked at
+    if (members.size() < end - begin)
+    {
+        // Marking them in a bitmap over the range puts them in order without sorting
+        Memory::FrameVector<glm::uint64> found((end - begin + 63) / 64, 0);
+        for (auto it = members.begin(); it != members.end(); it++)
+        {
+            size_t i = (*it)->flat_index;
+            if (i >= begin && i < end && flat_elements[i] == *it)
+            {
+                found[(i - begin) / 64] |= (glm::uint64)1 << ((i - begin) % 64);
+            }
+        }
 
-    if (element->getVisible() == false)
+        for (size_t word = 0; word < found.size(); word++)
+        {
+            glm::uint64 bits = found[word];
+            while (bits != 0)
+            {
+                size_t bit = 0;
+                while (((bits >> bit) & 1) == 0)
+                {
+                    bit++;
+                }
+                output.push_back(flat_elements[begin + word * 64 + bit]);
+                bits &= bits - 1;
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            if (members.count(flat_elements[i]) > 0)
+            {
+                output.push_back(flat_elements[i]);
+            }
+        }
+    }
+
+    return true;
+}
+
+void Engine::Document::indexId(Atom id, const std::shared_ptr<DOM::Element>& element)
+{
+    std::lock_guard<std::mutex> guard(id_lock);
+    id_index[id].push_back(IdEntry {element.get(), element});
+}
+
+void Engine::Document::unindexId(Atom id, const DOM::Element* element)
+{
+    std::lock_guard<std::mutex> guard(id_lock);
+    auto found = id_index.find(id);
+    if (found == id_index.end())
     {
         return;
     }
 
-    // element->render(delta);
-    Engine::Threading::addTask(std::bind(&Engine::DOM::Element::render, element, delta));
+    // Anything that's been destroyed without taking itself out goes too
+    auto& entries = found->second;
+    size_t i = 0;
+    while (i < entries.size())
+    {
+        if (entries[i].element == element || entries[i].reference.expired())
+        {
+            entries[i] = entries.back();
+            entries.pop_back();
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    if (entries.size() == 0)
+    {
+        id_index.erase(found);
+    }
+}
+
+std::shared_ptr<Engine::DOM::Element> Engine::Document::findElementById(const std::string& id, DOM::Element* scope)
+{
+    // An id that's never been interned can't belong to anything
+    return findElementById(Atom::find(id), scope);
+}
+
+std::shared_ptr<Engine::DOM::Element> Engine::Document::findElementById(Atom id, DOM::Element* scope)
+{
+    Memory::FrameVector<std::shared_ptr<DOM::Element>> found;
+    findElementsById(id, scope, found);
+    if (found.size() == 0)
+    {
+        return nullptr;
+    }
+    if (found.size() == 1 || scope == nullptr)
+    {
+        return found[0];
+    }
 
-    for (size_t i = 0; i < element->getChildren().size(); i++) {
-        renderElement(delta, element->getChildren()[i]);
-        
+    // The index isn't kept in any order, so when the id is shared the first one in the tree has to be found by walking it
+    for (DOM::TreeIterator it(scope); !it.done(); it.next())
+    {
+        if (it.get()->getIdAtom() == id)
+        {
+            for (size_t i = 0; i < found.size(); i++)
+            {
+                if (found[i].get() == it.get())
+                {
+                    return found[i];
+                }
+            }
+        }
     }
+    return found[0];
 }
 
-void Engine::Document::executeElement(float delta, std::shared_ptr<DOM::Element> element)
+void Engine::Document::findElementsById(const std::string& id, DOM::Element* scope, Memory::FrameVector<std::shared_ptr<DOM::Element>>& output)
 {
+    findElementsById(Atom::find(id), scope, output);
+}
 
-    if (element->getProcess() == false)
+void Engine::Document::findElementsById(Atom id, DOM::Element* scope, Memory::FrameVector<std::shared_ptr<DOM::Element>>& output)
+{
+    if (id.empty())
     {
         return;
     }
-    
-    if (element->inited != false)
+
+    // Letting go of one of these might destroy the element, which takes id_lock, so they're checked after it's unlocked
+    Memory::FrameVector<std::shared_ptr<DOM::Element>> candidates;
+    {
+        std::lock_guard<std::mutex> guard(id_lock);
+        auto found = id_index.find(id);
+        if (found == id_index.end())
+        {
+            return;
+        }
+
+        auto& entries = found->second;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            auto element = entries[i].reference.lock();
+            if (element != nullptr)
+            {
+                candidates.push_back(std::move(element));
+            }
+        }
+    }
+
+    for (size_t i = 0; i < candidates.size(); i++)
     {
-        Engine::Threading::addTask(std::bind(&Engine::DOM::Element::process, element, delta));
+        if (candidates[i]->isDescendantOf(scope))
+        {
+            output.push_back(candidates[i]);
+        }
     }
-    //element->process(delta);
-    //element->render(delta);
+}
 
-    for (size_t i = 0; i < element->getChildren().size(); i++)
+std::shared_ptr<Engine::DOM::Selector> Engine::Document::getSelector(const std::string& text)
+{
+    std::lock_guard<std::mutex> guard(selector_lock);
+    auto found = selector_cache.find(text);
+    if (found != selector_cache.end())
     {
-        executeElement(delta, element->getChildren()[i]);
+        return found->second;
+    }
+
+    // Invalid ones are cached as well, so a bad selector used every frame only logs once
+    auto selector = std::make_shared<DOM::Selector>(text, this);
+    selector_cache[text] = selector;
+    return selector;
+}
+
+void Engine::Document::deferRelease(std::shared_ptr<DOM::Element> element)
+{
+    released_lock.lock();
+    released.push_back(element);
+    released_lock.unlock();
+}
+
+void Engine::Document::deferRelease(std::vector<std::shared_ptr<DOM::Element>>& elements)
+{
+    released_lock.lock();
+    released.insert(released.end(), std::make_move_iterator(elements.begin()), std::make_move_iterator(elements.end()));
+    released_lock.unlock();
+    elements.clear();
+}
+
+void Engine::Document::recordMutation(const std::shared_ptr<DOM::Element>& node, const std::shared_ptr<DOM::Element>& old_parent, const std::shared_ptr<DOM::Element>& new_parent)
+{
+    std::lock_guard<std::mutex> guard(mutation_lock);
+
+    // If it's already moved this frame, it came from wherever it was then, and it's going wherever it is now
+    auto found = pending_mutation_index.find(node.get());
+    if (found != pending_mutation_index.end())
+    {
+        pending_mutations[found->second].new_parent = new_parent;
+        return;
+    }
+
+    pending_mutation_index[node.get()] = pending_mutations.size();
+    pending_mutations.push_back(DOM::MutationRecord {node, old_parent, new_parent});
+}
+
+int Engine::Document::addMutationObserver(std::function<void(const std::vector<DOM::MutationRecord>&)> callback)
+{
+    std::lock_guard<std::mutex> guard(observer_lock);
+    int observer = next_observer++;
+    mutation_observers[observer] = callback;
+    return observer;
+}
+
+void Engine::Document::removeMutationObserver(int observer)
+{
+    std::lock_guard<std::mutex> guard(observer_lock);
+    mutation_observers.erase(observer);
+}
+
+void Engine::Document::deliverMutations()
+{
+    std::vector<DOM::MutationRecord> records;
+    mutation_lock.lock();
+    records.swap(pending_mutations);
+    pending_mutation_index.clear();
+    mutation_lock.unlock();
+
+    // Anything that ended up back where it started hasn't really moved
+    size_t kept = 0;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        if (records[i].old_parent != records[i].new_parent)
+        {
+            records[kept] = std::move(records[i]);
+            kept++;
+        }
+    }
+    records.resize(kept);
+
+    if (records.size() == 0)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        if (records[i].old_parent != nullptr)
+        {
+            records[i].node->onParentRemoved();
+        }
+        if (records[i].new_parent != nullptr)
+        {
+            records[i].node->onParentAdded();
+        }
+    }
+
+    // Copied so an observer can add or remove observers
+    std::vector<std::function<void(const std::vector<DOM::MutationRecord>&)>> observers;
+    observer_lock.lock();
+    for (auto i = mutation_observers.begin(); i != mutation_observers.end(); i++)
+    {
+        observers.push_back(i->second);
+    }
+    observer_lock.unlock();
+
+    for (size_t i = 0; i < observers.size(); i++)
+    {
+        observers[i](records);
+    }
+}
+
+void Engine::Document::updateFlatTree()
+{
+    // Clear the flags first, so anything that changes while we're rebuilding gets picked up next time
+    if (tree_dirty.exchange(false))
+    {
+        flags_dirty = false;
+        rebuildFlatTree();
+        flat_version++;
+    }
+    else if (flags_dirty.exchange(false))
+    {
+        for (size_t i = 0; i < flat_elements.size(); i++)
+        {
+            flat_visible[i] = flat_elements[i]->getVisible();
+            flat_process[i] = flat_elements[i]->getProcess();
+        }
+        flat_version++;
+    }
+}
+
+void Engine::Document::rebuildFlatTree()
+{
+    // The tree is walked before taking flat_lock, since queries hold it while they might be holding tree locks.
+    // Removed elements are kept alive until the end of the frame, so raw pointers are fine
+    Memory::FrameVector<DOM::Element*> elements;
+    Memory::FrameVector<glm::uint32> depths;
+    if (base != nullptr)
+    {
+        elements.push_back(base.get());
+        depths.push_back(0);
+        for (DOM::TreeIterator it(base.get()); !it.done(); it.next())
+        {
+            elements.push_back(it.get());
+            depths.push_back((glm::uint32)it.depth());
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> guard(flat_lock);
+
+    size_t count = elements.size();
+    flat_elements.assign(elements.begin(), elements.end());
+    flat_depth.assign(depths.begin(), depths.end());
+    flat_parent.resize(count);
+    flat_visible.resize(count);
+    flat_process.resize(count);
+    flat_subtree_end.resize(count);
+    flat_changed.assign(count, false);
+
+    // The most recent element at each depth is the parent of anything one deeper
+    Memory::FrameVector<glm::int32> last_at_depth;
+    for (size_t i = 0; i < count; i++)
+    {
+        glm::uint32 depth = flat_depth[i];
+        flat_parent[i] = depth == 0 ? -1 : last_at_depth[depth - 1];
+        last_at_depth.resize(depth + 1);
+        last_at_depth[depth] = (glm::int32)i;
+
+        flat_elements[i]->flat_index = (glm::uint32)i;
+        flat_visible[i] = flat_elements[i]->getVisible();
+        flat_process[i] = flat_elements[i]->getProcess();
+        flat_subtree_end[i] = (glm::uint32)(i + 1);
+    }
+
+    // In pre-order every descendant comes straight after its ancestor, so going backwards each subtree is finished before its parent sees it
+    for (size_t i = count; i > 1; i--)
+    {
+        size_t parent = flat_parent[i - 1];
+        if (flat_subtree_end[i - 1] > flat_subtree_end[parent])
+        {
+            flat_subtree_end[parent] = flat_subtree_end[i - 1];
+        }
+    }
+}
+
+void Engine::Document::collectPendingInits()
+{
+    init_queue.clear();
+    init_cursor = 0;
+    init_version = flat_version;
+
+    size_t i = 0;
+    while (i < flat_elements.size())
+    {
+        if (flat_elements[i]->inited == false)
+        {
+            init_queue.push_back(flat_elements[i]);
+        }
+
+        // Children of invisible elements aren't inited until they're shown
+        if (flat_visible[i] == false)
+        {
+            i = flat_subtree_end[i];
+            continue;
+        }
+        i++;
+    }
+}
+
+void Engine::Document::initElements()
+{
+    auto init_start = std::chrono::steady_clock::now();
+    size_t inits = 0;
+
+    // An init() that adds or removes elements, or hides something, makes the queue out of date, so it's collected again and carries on
+    bool out_of_time = false;
+    while (out_of_time == false)
+    {
+        updateFlatTree();
+        if (init_version != flat_version)
+        {
+            collectPendingInits();
+        }
+
+        // The workers take everything that can go on them, while the main thread does the rest. Both stop when the budget's gone
+        Memory::FrameVector<DOM::Element*> async_inits;
+        for (size_t i = init_cursor; i < init_queue.size(); i++)
+        {
+            if (init_queue[i]->inited == false && init_queue[i]->canInitAsync())
+            {
+                async_inits.push_back(init_queue[i]);
+            }
+        }
+
+        std::atomic<size_t> async_done{0};
+        Engine::Threading::TaskGroup init_group;
+        if (async_inits.size() > 0)
+        {
+            init_group.addTask([this, &async_inits, &async_done, init_start]() {
+                Engine::Threading::parallelFor(0, async_inits.size(), [this, &async_inits, &async_done, init_start](size_t i) {
+                    if (i > 0 && init_budget > 0 && millisecondsSince(init_start) >= init_budget)
+                    {
+                        return;
+                    }
+                    async_inits[i]->init();
+                    async_inits[i]->inited = true;
+                    async_done++;
+                });
+            });
+        }
+
+        bool changed = false;
+        size_t next = init_cursor;
+        while (next < init_queue.size())
+        {
+            DOM::Element* element = init_queue[next];
+            if (element->canInitAsync() || element->inited)
+            {
+                next++;
+                continue;
+            }
+
+            if (init_budget > 0 && inits > 0 && millisecondsSince(init_start) >= init_budget)
+            {
+                out_of_time = true;
+                break;
+            }
+
+            element->init();
+            element->inited = true;
+            next++;
+            inits++;
+
+            if (tree_dirty || flags_dirty)
+            {
+                changed = true;
+                break;
+            }
+        }
+
+        init_group.wait();
+        inits += async_done;
+
+        // The workers can run out of time before the main thread does, so the cursor only moves past what's actually been inited
+        while (init_cursor < init_queue.size() && init_queue[init_cursor]->inited)
+        {
+            init_cursor++;
+        }
+
+        if (async_done < async_inits.size())
+        {
+            out_of_time = true;
+        }
+        else if (async_done > 0 && (tree_dirty || flags_dirty))
+        {
+            changed = true;
+        }
+
+        if (inits > 0)
+        {
+            schedule_dirty = true;
+        }
+        if (changed == false)
+        {
+            break;
+        }
+    }
+
+    tick_stats.init = millisecondsSince(init_start);
+    tick_stats.inits = inits;
+    tick_stats.pending_inits = 0;
+    for (size_t i = init_cursor; i < init_queue.size(); i++)
+    {
+        if (init_queue[i]->inited == false)
+        {
+            tick_stats.pending_inits++;
+        }
+    }
+}
+
+void Engine::Document::renderPhase(float delta)
+{
+    render_list.clear();
+    main_thread_renders.clear();
+    size_t i = 0;
+    while (i < flat_elements.size())
+    {
+        if (flat_visible[i] == false)
+        {
+            i = flat_subtree_end[i];
+            continue;
+        }
+
+        // Still waiting in the init queue
+        if (flat_elements[i]->inited == false)
+        {
+            i++;
+            continue;
+        }
+
+        if (flat_elements[i]->getMainThreadRender())
+        {
+            main_thread_renders.push_back(flat_elements[i]);
+        }
+        else
+        {
+            render_list.push_back(flat_elements[i]);
+        }
+        i++;
+    }
+
+    // The workers get on with the render list while the main thread does its own
+    Engine::Threading::TaskGroup render_group;
+    render_group.addTask([this, delta]() {
+        Engine::Threading::parallelFor(0, render_list.size(), [this, delta](size_t i) {
+            render_list[i]->render(delta);
+        });
+    });
+
+    for (size_t i = 0; i < main_thread_renders.size(); i++)
+    {
+        main_thread_renders[i]->render(delta);
+    }
+    render_group.wait();
+}
+
+// Subtrees this far down get their own task. Above this there aren't enough elements to be worth it
+const glm::uint32 propagate_split_depth = 2;
+
+void Engine::Document::transformPhase()
+{
+    updateFlatTree();
+
+    Engine::Threading::TaskGroup transform_group;
+    size_t i = 0;
+    while (i < flat_elements.size())
+    {
+        if (flat_depth[i] < propagate_split_depth)
+        {
+            propagateRange(i, i + 1);
+            i++;
+        }
+        else
+        {
+            size_t end = flat_subtree_end[i];
+            transform_group.addTask([this, i, end]() {
+                propagateRange(i, end);
+            });
+            i = end;
+        }
+    }
+    transform_group.wait();
+}
+
+void Engine::Document::propagateRange(size_t begin, size_t end)
+{
+    // Parents always come before their children, and anything above begin has already been done
+    for (size_t i = begin; i < end; i++)
+    {
+        bool parent_changed = false;
+        if (flat_parent[i] >= 0)
+        {
+            parent_changed = flat_changed[flat_parent[i]];
+        }
+        flat_changed[i] = flat_elements[i]->propagateTransform(parent_changed);
     }
 }
 
 void Engine::Document::destroy()
 {
+    sync();
     base->destroy();
+
+    // There won't be another tick to let go of them
+    released_lock.lock();
+    released.clear();
+    released_lock.unlock();
+
+    mutation_lock.lock();
+    pending_mutations.clear();
+    pending_mutation_index.clear();
+    mutation_lock.unlock();
     //self_ptr.reset();
 }
@@ -0,0 +1,323 @@
+#include "Engine/Memory.hpp"
+#include <map>
+#include <mutex>
+
+using namespace Engine;
+
+Memory::LinearArena::LinearArena(size_t size)
+: blocks(),
+current(0),
+offset(0),
+block_size(size),
+used(0),
+peak(0)
+{
+
+}
+
+Memory::LinearArena::~LinearArena()
+{
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        delete[] blocks[i].data;
+    }
+}
+
+void* Memory::LinearArena::allocate(size_t size, size_t alignment)
+{
+    // Keep going through the blocks we already have before making a new one
+    while (current < blocks.size())
+    {
+        Block& block = blocks[current];
+        std::uintptr_t start = reinterpret_cast<std::uintptr_t>(block.data) + offset;
+        size_t padding = (alignment - (start % alignment)) % alignment;
+
+        if (offset + padding + size <= block.size)
+        {
+            offset += padding + size;
+            used += size;
+            if (used > peak)
+            {
+                peak = used;
+            }
+            return reinterpret_cast<void*>(start + padding);
+        }
+
+        current++;
+        offset = 0;
+    }
+
+    // Out of room. Big allocations get a block to themselves
+    size_t new_size = block_size;
+    if (size + alignment > new_size)
+    {
+        new_size = size + alignment;
+    }
+
+    blocks.push_back(Block {new char[new_size], new_size});
+    current = blocks.size() - 1;
+    offset = 0;
+    return allocate(size, alignment);
+}
+
+void Memory::LinearArena::reset()
+{
+    current = 0;
+    offset = 0;
+    used = 0;
+}
+
+size_t Memory::LinearArena::getReserved() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        total += blocks[i].size;
+    }
+    return total;
+}
+
+// Every frame arena that's been made. They're never freed, but when a thread finishes its arena is given to the next thread that registers
+std::mutex arenas_lock;
+std::vector<Memory::LinearArena*> frame_arenas;
+std::vector<Memory::LinearArena*> free_arenas;
+
+struct ThreadArena
+{
+    Memory::LinearArena* arena = nullptr;
+
+    // Whether it's one of frame_arenas, or belongs to a thread outside the pool
+    bool frame = false;
+
+    ~ThreadArena()
+    {
+        if (arena == nullptr)
+        {
+            return;
+        }
+
+        if (frame)
+        {
+            std::lock_guard<std::mutex> guard(arenas_lock);
+            free_arenas.push_back(arena);
+        }
+        else
+        {
+            delete arena;
+        }
+    }
+};
+thread_local ThreadArena frame_arena;
+
+// What the last frame used, since the arenas have been reset by the time anyone asks
+size_t last_frame_used = 0;
+size_t peak_frame_used = 0;
+
+void Memory::registerFrameThread()
+{
+    if (frame_arena.frame)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(arenas_lock);
+    if (frame_arena.arena != nullptr)
+    {
+        // It already has one of its own, which can be reset along with the others from now on
+        frame_arenas.push_back(frame_arena.arena);
+    }
+    else if (free_arenas.size() > 0)
+    {
+        frame_arena.arena = free_arenas.back();
+        free_arenas.pop_back();
+    }
+    else
+    {
+        frame_arena.arena = new LinearArena();
+        frame_arenas.push_back(frame_arena.arena);
+    }
+    frame_arena.frame = true;
+}
+
+bool Memory::hasFrameArena()
+{
+    return frame_arena.frame;
+}
+
+Memory::LinearArena& Memory::getFrameArena()
+{
+    if (frame_arena.arena == nullptr)
+    {
+        // Not a frame thread, so this one's only ever reset by the thread itself
+        frame_arena.arena = new LinearArena();
+    }
+
+    return *frame_arena.arena;
+}
+
+void Memory::resetFrameArenas()
+{
+    std::lock_guard<std::mutex> guard(arenas_lock);
+
+    size_t total = 0;
+    for (size_t i = 0; i < frame_arenas.size(); i++)
+    {
+        total += frame_arenas[i]->getUsed();
+        frame_arenas[i]->reset();
+    }
+
+    last_frame_used = total;
+    if (total > peak_frame_used)
+    {
+        peak_frame_used = total;
+    }
+}
+
+Memory::FrameStats Memory::getFrameStats()
+{
+    std::lock_guard<std::mutex> guard(arenas_lock);
+
+    FrameStats output;
+    output.bytes_used = last_frame_used;
+    output.peak_bytes = peak_frame_used;
+    output.arenas = (int)frame_arenas.size();
+    for (size_t i = 0; i < frame_arenas.size(); i++)
+    {
+        output.bytes_reserved += frame_arenas[i]->getReserved();
+    }
+    return output;
+}
+
+Memory::ObjectPool::ObjectPool(size_t size, size_t align, size_t per_chunk)
+: chunks(),
+free_list(nullptr),
+block_size(size),
+alignment(align),
+blocks_per_chunk(per_chunk),
+used(0),
+peak(0)
+{
+    // Free blocks hold the free list, so they have to be able to fit a pointer
+    if (block_size < sizeof(FreeBlock))
+    {
+        block_size = sizeof(FreeBlock);
+    }
+    if (alignment < alignof(FreeBlock))
+    {
+        alignment = alignof(FreeBlock);
+    }
+    block_size = (block_size + alignment - 1) / alignment * alignment;
+}
+
+Memory::ObjectPool::~ObjectPool()
+{
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        ::operator delete[](chunks[i], std::align_val_t(alignment));
+    }
+}
+
+void* Memory::ObjectPool::allocate()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (free_list == nullptr)
+    {
+        // Out of blocks. Make a new chunk and put all of it on the free list
+        char* chunk = static_cast<char*>(::operator new[](block_size * blocks_per_chunk, std::align_val_t(alignment)));
+        chunks.push_back(chunk);
+        for (size_t i = blocks_per_chunk; i > 0; i--)
+        {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + (i - 1) * block_size);
+            block->next = free_list;
+            free_list = block;
+        }
+    }
+
+    FreeBlock* block = free_list;
+    free_list = block->next;
+
+    used++;
+    if (used > peak)
+    {
+        peak = used;
+    }
+    return block;
+}
+
+void Memory::ObjectPool::deallocate(void* pointer)
+{
+    if (pointer == nullptr)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    FreeBlock* block = static_cast<FreeBlock*>(pointer);
+    block->next = free_list;
+    free_list = block;
+    used--;
+}
+
+size_t Memory::ObjectPool::getUsed()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return used;
+}
+
+size_t Memory::ObjectPool::getPeak()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return peak;
+}
+
+size_t Memory::ObjectPool::getReserved()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return chunks.size() * blocks_per_chunk * block_size;
+}
+
+// Every pool, by the size and alignment it was made for. Types with the same size share one.
+// They're never freed, since objects from them can still be around while the program is shutting down
+std::mutex& getPoolsLock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+std::map<std::pair<size_t, size_t>, Memory::ObjectPool*>& getPools()
+{
+    static std::map<std::pair<size_t, size_t>, Memory::ObjectPool*> pools;
+    return pools;
+}
+
+Memory::ObjectPool& Memory::getPool(size_t size, size_t alignment)
+{
+    std::lock_guard<std::mutex> guard(getPoolsLock());
+
+    auto& pools = getPools();
+    auto found = pools.find(std::make_pair(size, alignment));
+    if (found != pools.end())
+    {
+        return *found->second;
+    }
+
+    ObjectPool* pool = new ObjectPool(size, alignment);
+    pools[std::make_pair(size, alignment)] = pool;
+    return *pool;
+}
+
+Memory::PoolStats Memory::getPoolStats()
+{
+    std::lock_guard<std::mutex> guard(getPoolsLock());
+
+    PoolStats output;
+    auto& pools = getPools();
+    for (auto i = pools.begin(); i != pools.end(); i++)
+    {
+        output.bytes_used += i->second->getUsed() * i->second->getBlockSize();
+        output.bytes_reserved += i->second->getReserved();
+    }
+    output.pools = (int)pools.size();
+    return output;
+}
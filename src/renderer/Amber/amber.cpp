@@ -67,10 +67,16 @@ std::function<void()> loop_func;
 
 Amber::Amber(std::shared_ptr<Document> doc): document(doc),
 offset(),
-old_position()
+old_position(),
+key_state(),
+button_state(),
+scroll_offset(0),
+requested_mouse_mode(Engine::Input::MouseMode::Free),
+requested_cursor_mode(Engine::Input::CursorMode::Visible)
 {
     doc->renderer = std::shared_ptr<Amber>(this);
     mouse_mode = Engine::Input::MouseMode::Free;
+    cursor_mode = Engine::Input::CursorMode::Visible;
 }
 
 Amber::~Amber()
@@ -196,6 +202,7 @@ void Amber::mainloop(std::function<void(float)> func)
     }
 #endif
 
+    document->sync();
     destroy();
     document->destroy();
     Engine::Threading::cleanup();
@@ -240,8 +247,15 @@ bool Amber::loop()
 
     frameCount ++;
 
+    // The document might still be processing the next frame (see Document::setFrameLatency). That has to finish before the input changes
+    document->sync();
+
+    // Deal with the scroll wheel
+    _scroll_offset = 0;
+
     // Check for keypresses
     glfwPollEvents();
+    pollInput();
 
     // Start Nuklear frame
     nk_glfw3_new_frame(&glfw);
@@ -302,13 +316,6 @@ bool Amber::loop()
         old_position = glm::vec2(x,y);
     }
 
-    // Flip the render buffers... kinda
-    current_frame = next_frame;
-    next_frame = std::vector<PipeItem>();
-
-    current_light_frame = next_light_frame;
-    next_light_frame = std::vector<std::shared_ptr<E3D::LightElement3D>>();
-
     // Run our render function
     render_func(delta);
 
@@ -324,9 +331,6 @@ bool Amber::loop()
     // Swap the buffers so it actually shows up
     glfwSwapBuffers(window);
 
-    // Deal with the scroll wheel
-    _scroll_offset = 0;
-
     return true;
 }
 
@@ -368,6 +372,39 @@ void AmberShaderProgram::checkCompileErrors(glm::uint32 shader, AmberShaderType
     }
 }
 
+void Amber::pollInput()
+{
+    // Nothing is processing right now (loop() synced the document first), so this can't change under an element
+    for (int key = GLFW_KEY_SPACE; key <= GLFW_KEY_LAST; key++)
+    {
+        key_state[key] = glfwGetKey(window, key) == GLFW_PRESS;
+    }
+
+    for (int button = GLFW_MOUSE_BUTTON_1; button <= GLFW_MOUSE_BUTTON_LAST; button++)
+    {
+        button_state[button] = glfwGetMouseButton(window, button) == GLFW_PRESS;
+    }
+
+    scroll_offset = _scroll_offset;
+
+    // Apply whatever elements asked for last frame
+    mouse_mode = requested_mouse_mode.load();
+
+    Engine::Input::CursorMode new_cursor_mode = requested_cursor_mode.load();
+    if (new_cursor_mode != cursor_mode)
+    {
+        cursor_mode = new_cursor_mode;
+        if (cursor_mode == Engine::Input::CursorMode::Hidden)
+        {
+            glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
+        }
+        else
+        {
+            glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+        }
+    }
+}
+
 glm::vec2 Amber::getMouseOffset()
 {
     return offset;
@@ -383,7 +420,7 @@ void onScroll(GLFWwindow* window, double xoffset, double yoffset)
 
 float Amber::getScrollWheelOffset()
 {
-    return Amber::_scroll_offset;
+    return scroll_offset;
 }
 
 void AmberShaderProgram::loadShaders(std::shared_ptr<ShaderResource> vert, std::shared_ptr<ShaderResource> frag)
@@ -440,52 +477,52 @@ void AmberShaderProgram::use()
     }
 }
 
-GLint AmberShaderProgram::getUniformLocation(const std::string name) 
+GLint AmberShaderProgram::getUniformLocation(const std::string& name) 
 {
     std::map<std::string, GLint>::iterator it = uniform_locations.find(name);
     if (it == uniform_locations.end())
     {
-        uniform_locations[name] = glGetUniformLocation(handle, name.c_str());
+        it = uniform_locations.insert(std::make_pair(name, glGetUniformLocation(handle, name.c_str()))).first;
     }
 
-    return uniform_locations[name];
+    return it->second;
     // return glGetUniformLocation(handle, name.c_str());
 }
 
-void AmberShaderProgram::setUniform(const std::string name, const glm::vec2& v)
+void AmberShaderProgram::setUniform(const std::string& name, const glm::vec2& v)
 {
     GLint loc = getUniformLocation(name);
     glUniform2f(loc, v.x, v.y);
 }
-void AmberShaderProgram::setUniform(const std::string name, const glm::vec3& v)
+void AmberShaderProgram::setUniform(const std::string& name, const glm::vec3& v)
 {
     GLint loc = getUniformLocation(name);
     glUniform3f(loc, v.x, v.y, v.z);
 }
-void AmberShaderProgram::setUniform(const std::string name, const glm::vec4& v)
+void AmberShaderProgram::setUniform(const std::string& name, const glm::vec4& v)
 {
     GLint loc = getUniformLocation(name);
     glUniform4f(loc, v.x, v.y, v.z, v.w);
 }
-void AmberShaderProgram::setUniform(const std::string name, const glm::mat4& v)
+void AmberShaderProgram::setUniform(const std::string& name, const glm::mat4& v)
 {
     GLint loc = getUniformLocation(name);
     glUniformMatrix4fv(loc, 1, GL_FALSE, glm::value_ptr(v));
 }
 
-void AmberShaderProgram::setUniform(const std::string name, const int& v)
+void AmberShaderProgram::setUniform(const std::string& name, const int& v)
 {
     GLint loc = getUniformLocation(name);
     glUniform1i(loc, v);
 }
 
-void AmberShaderProgram::setUniform(const std::string name, const float& v)
+void AmberShaderProgram::setUniform(const std::string& name, const float& v)
 {
     GLint loc = getUniformLocation(name);
     glUniform1f(loc, v);
 }
 
-void AmberShaderProgram::setUniform(const std::string name, const bool& v)
+void AmberShaderProgram::setUniform(const std::string& name, const bool& v)
 {
     GLint loc = getUniformLocation(name);
     glUniform1i(loc, v);
@@ -553,16 +590,16 @@ void Amber::renderRenderObject(std::shared_ptr<RenderObject> model, glm::mat4 tr
     Amber::makeCurrent();
     model->shader_program->use();
 
-    if (!has_camera)
+    if (!current_has_camera)
     {
         return;
     }
 
     // Set uniforms
     // TODO: Do this in a more scalable way
-    glm::mat4 mv = camera->_getViewMatrix() * trans;
+    glm::mat4 mv = current_view * trans;
     model->shader_program->setUniform("projection", glm::perspective((float)0.8726646, (float)screen_width/screen_height, 0.1f, 100.0f));
-    model->shader_program->setUniform("view", camera->_getViewMatrix());
+    model->shader_program->setUniform("view", current_view);
     model->shader_program->setUniform("transform", trans);
     model->shader_program->setUniform("model_view", mv);
     // model->shader_program->setUniform("normal_transform", glm::mat3(mv));
@@ -583,7 +620,30 @@ void Amber::drawFrame(float delta)
     }
 }
 
-void Amber::renderPipeItem(PipeItem p)
+void Amber::finishQueue()
+{
+    // Flip the render buffers. Swapping keeps both vectors' memory around, so this doesn't allocate once they're big enough
+    next_lock.lock();
+    current_frame.swap(next_frame);
+    next_frame.clear();
+    next_lock.unlock();
+
+    next_light_lock.lock();
+    current_light_frame.swap(next_light_frame);
+    next_light_frame.clear();
+    next_light_lock.unlock();
+
+    // The transform phase is done and nothing is processing, so the camera is where it should be for this queue
+    camera_lock.lock();
+    current_has_camera = has_camera;
+    if (has_camera)
+    {
+        current_view = camera->_getViewMatrix();
+    }
+    camera_lock.unlock();
+}
+
+void Amber::renderPipeItem(const PipeItem& p)
 {
     glm::mat4 trans = p.global * p.local;
     p.object->checkInited();
@@ -619,15 +679,19 @@ void Amber::addToRenderQueue(std::shared_ptr<RenderObject> obj, std::shared_ptr<
 
 void Amber::addLight(std::shared_ptr<E3D::LightElement3D> light)
 {
+    LightData data = light->getLightData();
+
     next_light_lock.lock();
-    next_light_frame.push_back(light);
+    next_light_frame.push_back(data);
     next_light_lock.unlock();
 }
 
 void Amber::setCamera(std::shared_ptr<ICamera> cam)
 {
+    camera_lock.lock();
     has_camera = true;
     camera = cam;
+    camera_lock.unlock();
 
     try
     {
@@ -646,6 +710,7 @@ void Amber::setCamera(std::shared_ptr<ICamera> cam)
 
 std::shared_ptr<ICamera> Amber::getCamera()
 {
+    std::lock_guard<std::mutex> guard(camera_lock);
     if (!has_camera)
     {
         LOG_WARN("Trying to get camera with no active camera");
@@ -656,40 +721,34 @@ std::shared_ptr<ICamera> Amber::getCamera()
 
 bool Amber::isKeyPressed(int key)
 {
-    if (glfwGetKey(window, key) == GLFW_PRESS)
+    if (key < GLFW_KEY_SPACE || key > GLFW_KEY_LAST)
     {
-        return true;
+        return false;
     }
-    
-    return false;
+
+    return key_state[key];
 }
 
 bool Amber::isMouseButtonPressed(int button)
 {
-    if (glfwGetMouseButton(window, button) == GLFW_PRESS)
+    if (button < GLFW_MOUSE_BUTTON_1 || button > GLFW_MOUSE_BUTTON_LAST)
     {
-        return true;
+        return false;
     }
-    
-    return false;
+
+    return button_state[button];
 }
 
 // Mouse stuff
+// These can be called from process(), so they only ask. pollInput applies them on the main thread next frame
 void Amber::setCursorMode(Engine::Input::CursorMode mode)
 {
-    if (mode == Engine::Input::CursorMode::Hidden)
-    {
-        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
-    }
-    else
-    {
-        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
-    }
+    requested_cursor_mode = mode;
 }
 
 void Amber::setMouseMode(Engine::Input::MouseMode mode)
 {
-    mouse_mode = mode;
+    requested_mouse_mode = mode;
 }
 
 void Amber::destroy()
@@ -3,12 +3,16 @@
 #include <cstring>
 #include <filesystem>
 #include <lz4.h>
+#include <mutex>
 
 glm::uint16 Engine::Res::ResourceManager::version = 1;
 
 std::string directory = "";
 std::map<std::string, std::shared_ptr<Engine::Res::IResource>> cache = std::map<std::string, std::shared_ptr<Engine::Res::IResource>>();
 
+// Resources can be loaded from inside tasks
+std::mutex cache_lock;
+
 Engine::Res::FileType Engine::Res::IResource::file_type = FileType::text;
 
 std::string Engine::Res::ResourceManager::dirname(std::string source)
@@ -48,6 +52,7 @@ void Engine::Res::ResourceManager::start(int argc, char const* argv[])
 std::shared_ptr<Engine::Res::IResource> Engine::Res::ResourceManager::getCachedRes(std::string filename)
 {
     // std::shared_ptr<IResource> ptr;
+    std::lock_guard<std::mutex> guard(cache_lock);
     try {
         return cache.at(filename);
     }
@@ -59,6 +64,7 @@ std::shared_ptr<Engine::Res::IResource> Engine::Res::ResourceManager::getCachedR
 
 void Engine::Res::ResourceManager::setCachedRes(std::string filename, std::shared_ptr<IResource> res)
 {
+    std::lock_guard<std::mutex> guard(cache_lock);
     cache[filename] = res;
 }
 
@@ -1,47 +1,877 @@
 #include "Engine/Engine.hpp"
-#define ENGINE_NO_THREADING
+#include "Engine/Res.hpp"
 #ifdef __EMSCRIPTEN__
 #define ENGINE_NO_THREADING
 #endif
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <deque>
 #include <queue>
 #include <mutex>
+#include <random>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
 using namespace Engine;
 
-std::vector<std::thread> pool;
+// What actually sits in the queues
+struct TaskNode
+{
+    Threading::Task task;
+
+    // If the task was added through a TaskGroup, this gets told when it finishes
+    Threading::TaskGroup* group;
+
+    // False if this was allocated with new, and has to be deleted
+    bool from_arena;
+
+    // Only set while recording or replaying, see nextTaskKey
+    std::uint64_t key;
+};
+
+/*
+Chase-Lev work stealing deque ("Correct and Efficient Work-Stealing for Weak Memory Models", Le et al. 2013)
+Only the owning thread may call push() and pop(). Any thread can call steal()
+*/
+class WorkQueue
+{
+    private:
+        struct Buffer
+        {
+            std::int64_t size;
+            std::int64_t mask;
+            std::atomic<TaskNode*>* slots;
+
+            Buffer(std::int64_t new_size): size(new_size), mask(new_size - 1)
+            {
+                slots = new std::atomic<TaskNode*>[size];
+            }
+
+            ~Buffer()
+            {
+                delete[] slots;
+            }
+
+            TaskNode* get(std::int64_t i)
+            {
+                return slots[i & mask].load(std::memory_order_relaxed);
+            }
+
+            void put(std::int64_t i, TaskNode* task)
+            {
+                slots[i & mask].store(task, std::memory_order_relaxed);
+            }
+
+            Buffer* grow(std::int64_t bottom, std::int64_t top)
+            {
+                Buffer* bigger = new Buffer(size * 2);
+                for (std::int64_t i = top; i < bottom; i++)
+                {
+                    bigger->put(i, get(i));
+                }
+                return bigger;
+            }
+        };
+
+        alignas(64) std::atomic<std::int64_t> top;
+        alignas(64) std::atomic<std::int64_t> bottom;
+        std::atomic<Buffer*> buffer;
+
+        // Thieves might still be reading an old buffer after we grow, so they're only freed in the destructor
+        std::vector<Buffer*> old_buffers;
+
+    public:
+        WorkQueue(std::int64_t capacity = 1024): top(0), bottom(0), buffer(new Buffer(capacity)), old_buffers() {}
+
+        ~WorkQueue()
+        {
+            delete buffer.load();
+            for (size_t i = 0; i < old_buffers.size(); i++)
+            {
+                delete old_buffers[i];
+            }
+        }
+
+        void push(TaskNode* task)
+        {
+            std::int64_t b = bottom.load(std::memory_order_relaxed);
+            std::int64_t t = top.load(std::memory_order_acquire);
+            Buffer* a = buffer.load(std::memory_order_relaxed);
+
+            if (b - t > a->size - 1)
+            {
+                // Full, make it bigger
+                old_buffers.push_back(a);
+                a = a->grow(b, t);
+                buffer.store(a, std::memory_order_release);
+            }
+
+            a->put(b, task);
+            bottom.store(b + 1, std::memory_order_release);
+        }
+
+        TaskNode* pop()
+        {
+            std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Buffer* a = buffer.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t t = top.load(std::memory_order_relaxed);
+
+            if (t > b)
+            {
+                // Empty
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+
+            TaskNode* task = a->get(b);
+            if (t == b)
+            {
+                // Last item, so we have to race the thieves for it
+                if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                {
+                    task = nullptr;
+                }
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return task;
+        }
+
+        TaskNode* steal()
+        {
+            std::int64_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::int64_t b = bottom.load(std::memory_order_acquire);
+
+            if (t >= b)
+            {
+                return nullptr;
+            }
+
+            Buffer* a = buffer.load(std::memory_order_acquire);
+            TaskNode* task = a->get(t);
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                // Somebody else got it first
+                return nullptr;
+            }
+            return task;
+        }
+
+        bool empty() const
+        {
+            return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+        }
+};
+
+/*
+Bump allocator for TaskNodes. Each thread with a queue has one, and allocates the tasks it adds from it.
+reset() rewinds it without freeing anything, so once it's grown to fit a frame it never allocates again
+*/
+class TaskArena
+{
+    private:
+        typedef std::aligned_storage<sizeof(TaskNode), alignof(TaskNode)>::type NodeStorage;
+        static const size_t block_size = 1024;
+
+        std::vector<NodeStorage*> blocks;
+        size_t block;
+        size_t used;
+
+    public:
+        TaskArena(): blocks(), block(0), used(0) {}
+
+        ~TaskArena()
+        {
+            for (size_t i = 0; i < blocks.size(); i++)
+            {
+                delete[] blocks[i];
+            }
+        }
+
+        void* allocate(bool& new_block)
+        {
+            new_block = false;
+            if (used == block_size)
+            {
+                block++;
+                used = 0;
+            }
+
+            if (block == blocks.size())
+            {
+                blocks.push_back(new NodeStorage[block_size]);
+                new_block = true;
+            }
+
+            return &blocks[block][used++];
+        }
+
+        // Only safe once every task allocated from this arena has finished
+        void reset()
+        {
+            block = 0;
+            used = 0;
+        }
+
+        size_t getBytes() const
+        {
+            return blocks.size() * block_size * sizeof(NodeStorage);
+        }
+};
+
+std::vector<std::thread> pool;
+
+// Critical and Normal tasks are part of the frame, and get a queue each on every thread.
+// Background tasks never go in here, they're run by the lesser threads
+const int frame_priorities = 2;
+
+struct WorkerQueues
+{
+    WorkQueue by_priority[frame_priorities];
+};
+
+// Queue 0 belongs to the thread that called startThreads (the main thread), the rest to each worker
+std::vector<WorkerQueues*> queues;
+
+// Tasks added from threads that don't own a queue end up here
+struct InjectedQueue
+{
+    std::queue<TaskNode*> tasks;
+    std::mutex lock;
+    std::atomic<int> count;
+
+    InjectedQueue(): tasks(), lock(), count(0) {}
+};
+InjectedQueue injected[frame_priorities];
+
+std::queue<Threading::Task> lesser_tasks;
+
+// One per queue. Only the owning thread allocates from it, and only the main thread resets them
+std::vector<TaskArena*> arenas;
+thread_local TaskArena* thread_arena = nullptr;
+
+std::atomic<unsigned long> heap_tasks(0);
+std::atomic<unsigned long> arena_blocks(0);
+std::mutex tasks_lock;
+std::condition_variable lesser_available;
+
+// Background tasks that have been added but haven't finished
+std::atomic<int> pending_background(0);
+
+// Tasks of each priority that are waiting to be picked up
+std::atomic<int> queue_depth[3];
+
+// Tasks that have been added but haven't finished running yet
+std::atomic<int> pending_tasks(0);
+
+// Tasks that are sitting in a queue waiting for someone to pick them up
+std::atomic<int> queued_tasks(0);
+
+// Idle threads park on this after spinning for a bit
+std::mutex sleep_lock;
+std::condition_variable work_available;
+std::atomic<int> sleeping_threads(0);
+std::atomic<int> completion_waiters(0);
+
+std::atomic<bool> running(false);
+
+thread_local int queue_index = -1;
+
+// How many times an idle thread looks for work before it goes to sleep.
+// Grows when spinning pays off, and shrinks when it doesn't
+const int min_spin = 16;
+const int max_spin = 4096;
+
+struct StatsSlot
+{
+    std::atomic<std::uint64_t> busy_ns;
+    std::atomic<std::uint64_t> idle_ns;
+    std::atomic<std::uint64_t> tasks_run;
+
+    StatsSlot(): busy_ns(0), idle_ns(0), tasks_run(0) {}
+};
+
+std::atomic<bool> profiling(false);
+std::vector<StatsSlot*> stats;
+thread_local StatsSlot* thread_stats = nullptr;
+
+std::uint64_t nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+    _mm_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Wakes up a parked thread if there are any. The lock makes sure we can't slip in between
+// a thread checking for work and it starting to wait
+void wakeSleeper()
+{
+    if (sleeping_threads.load(std::memory_order_seq_cst) > 0)
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        work_available.notify_one();
+    }
+}
+
+TaskNode* takeTask(int priority, int index, std::minstd_rand& random)
+{
+    TaskNode* task = nullptr;
+
+    // Our own tasks first, they're most likely to still be in cache
+    if (index >= 0)
+    {
+        task = queues[index]->by_priority[priority].pop();
+        if (task != nullptr)
+        {
+            return task;
+        }
+    }
+
+    InjectedQueue& inject = injected[priority];
+    if (inject.count.load(std::memory_order_relaxed) > 0)
+    {
+        inject.lock.lock();
+        if (!inject.tasks.empty())
+        {
+            task = inject.tasks.front();
+            inject.tasks.pop();
+            inject.count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        inject.lock.unlock();
+
+        if (task != nullptr)
+        {
+            return task;
+        }
+    }
+
+    // Then try to steal from everyone else, starting somewhere random so the thieves spread out
+    size_t amount = queues.size();
+    size_t start = random() % amount;
+    for (size_t i = 0; i < amount; i++)
+    {
+        size_t victim = (start + i) % amount;
+        if ((int)victim == index)
+        {
+            continue;
+        }
+
+        task = queues[victim]->by_priority[priority].steal();
+        if (task != nullptr)
+        {
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+TaskNode* findTask(int index, std::minstd_rand& random)
+{
+    for (int priority = 0; priority < frame_priorities; priority++)
+    {
+        if (queue_depth[priority].load(std::memory_order_relaxed) <= 0)
+        {
+            continue;
+        }
+
+        TaskNode* task = takeTask(priority, index, random);
+        if (task != nullptr)
+        {
+            queue_depth[priority].fetch_sub(1, std::memory_order_relaxed);
+            queued_tasks.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+
+// ==============================================
+// Recording and replaying
+
+// Set while recording or replaying. Tasks only get keys and timings while this is on
+std::atomic<bool> tracing(false);
+std::atomic<bool> recording(false);
+std::atomic<bool> replaying(false);
+
+// The key of the task this thread is running (0 for the main thread outside of tasks), and how many tasks it's added so far
+thread_local std::uint64_t current_key = 0;
+thread_local std::uint32_t child_count = 0;
+
+std::thread::id main_thread;
+std::atomic<std::uint64_t> frame_start(0);
+
+// What ran this frame, in no particular order until the frame ends
+std::mutex trace_lock;
+std::vector<Threading::TaskTrace> trace_events;
+std::vector<Threading::TaskTrace> last_frame_trace;
+
+typedef std::vector<Threading::TaskTrace> TraceFrame;
+
+std::string record_filename;
+int record_frames_left = 0;
+std::vector<TraceFrame> recorded_frames;
+
+std::mutex replay_lock;
+std::vector<TraceFrame> replay_frames;
+size_t replay_frame = 0;
+
+// Which entries of the current replay frame have been run, and the first one that hasn't
+std::vector<bool> replay_used;
+size_t replay_cursor = 0;
+
+// Tasks added while replaying wait here until their turn comes up
+std::unordered_multimap<std::uint64_t, TaskNode*> replay_pending;
+
+// Keys in the order they were added, for tasks that aren't in the recording
+std::deque<std::uint64_t> replay_order;
+
+bool isMainThread()
+{
+    return std::this_thread::get_id() == main_thread;
+}
+
+// Keys are built from the key of the task doing the adding and how many tasks it has added before.
+// As long as each task adds the same things in the same order, a task gets the same key every run, no matter which thread runs it
+std::uint64_t nextTaskKey()
+{
+    std::uint64_t key = current_key ^ (++child_count + 0x9e3779b97f4a7c15ULL + (current_key << 6) + (current_key >> 2));
+
+    // splitmix64's finaliser, so nearby keys don't end up nearby
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+std::uint32_t clampNs(std::uint64_t ns)
+{
+    return ns > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (std::uint32_t)ns;
+}
+
+// Runs a task as `key`, so that anything it adds is keyed off it, and notes down when it ran
+void runKeyed(Threading::Task& task, std::uint64_t key)
+{
+    std::uint64_t parent_key = current_key;
+    std::uint32_t parent_children = child_count;
+    current_key = key;
+    child_count = 0;
+
+    std::uint64_t start = nowNs();
+    task();
+    std::uint64_t end = nowNs();
+
+    current_key = parent_key;
+    child_count = parent_children;
+
+    std::uint64_t frame_began = frame_start.load(std::memory_order_relaxed);
+
+    Threading::TaskTrace trace;
+    trace.key = key;
+    trace.thread = queue_index;
+    trace.start = clampNs(start > frame_began ? start - frame_began : 0);
+    trace.duration = clampNs(end - start);
+
+    std::lock_guard<std::mutex> guard(trace_lock);
+    trace_events.push_back(trace);
+}
+
+void queueReplay(TaskNode* task)
+{
+    {
+        std::lock_guard<std::mutex> guard(replay_lock);
+        replay_pending.insert(std::make_pair(task->key, task));
+        replay_order.push_back(task->key);
+    }
+
+    // The main thread might be parked waiting on something else
+    Threading::notifyWaiters();
+}
+
+TaskNode* takePending(std::uint64_t key)
+{
+    auto it = replay_pending.find(key);
+    if (it == replay_pending.end())
+    {
+        return nullptr;
+    }
+
+    TaskNode* task = it->second;
+    replay_pending.erase(it);
+    return task;
+}
+
+// Returns the next task in recorded order. Tasks that weren't recorded (because the code changed, say) run afterwards in the order they were added
+TaskNode* takeReplayTask()
+{
+    std::lock_guard<std::mutex> guard(replay_lock);
+    if (replay_pending.empty())
+    {
+        return nullptr;
+    }
+
+    if (replay_frame < replay_frames.size())
+    {
+        const TraceFrame& frame = replay_frames[replay_frame];
+        while (replay_cursor < frame.size() && replay_used[replay_cursor])
+        {
+            replay_cursor++;
+        }
+
+        for (size_t i = replay_cursor; i < frame.size(); i++)
+        {
+            if (replay_used[i])
+            {
+                continue;
+            }
+
+            TaskNode* task = takePending(frame[i].key);
+            if (task != nullptr)
+            {
+                replay_used[i] = true;
+                return task;
+            }
+        }
+    }
+
+    while (!replay_order.empty())
+    {
+        std::uint64_t key = replay_order.front();
+        replay_order.pop_front();
+
+        TaskNode* task = takePending(key);
+        if (task != nullptr)
+        {
+            return task;
+        }
+    }
+
+    return nullptr;
+}
+
+void startReplayFrame()
+{
+    replay_cursor = 0;
+    replay_order.clear();
+    if (replay_frame < replay_frames.size())
+    {
+        replay_used.assign(replay_frames[replay_frame].size(), false);
+    }
+}
+
+void saveRecording();
+
+// Called on the main thread once every frame task has finished
+void endTraceFrame()
+{
+    if (!tracing.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(trace_lock);
+        last_frame_trace.swap(trace_events);
+        trace_events.clear();
+    }
+
+    std::sort(last_frame_trace.begin(), last_frame_trace.end(), [](const Threading::TaskTrace& a, const Threading::TaskTrace& b) {
+        return a.start < b.start;
+    });
+
+    if (recording.load(std::memory_order_relaxed))
+    {
+        recorded_frames.push_back(last_frame_trace);
+        record_frames_left--;
+        if (record_frames_left <= 0)
+        {
+            saveRecording();
+        }
+    }
+
+    if (replaying.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> guard(replay_lock);
+        replay_frame++;
+        if (replay_frame >= replay_frames.size())
+        {
+            LOG_INFO("Replay finished after " + std::to_string(replay_frames.size()) + " frames");
+            replaying = false;
+            replay_frames.clear();
+        }
+        else
+        {
+            startReplayFrame();
+        }
+    }
+
+    tracing = recording.load() || replaying.load();
+    child_count = 0;
+    frame_start = nowNs();
+}
+
+void runTask(TaskNode* task)
+{
+    if (tracing.load(std::memory_order_relaxed))
+    {
+        runKeyed(task->task, task->key);
+    }
+    else if (profiling.load(std::memory_order_relaxed) && thread_stats != nullptr)
+    {
+        std::uint64_t start = nowNs();
+        task->task();
+        thread_stats->busy_ns.fetch_add(nowNs() - start, std::memory_order_relaxed);
+        thread_stats->tasks_run.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+        task->task();
+    }
+
+    Threading::TaskGroup* group = task->group;
+    if (task->from_arena)
+    {
+        // The memory goes back when the arena is reset
+        task->~TaskNode();
+    }
+    else
+    {
+        delete task;
+    }
+
+    if (group != nullptr)
+    {
+        group->_end();
+    }
+
+    if (pending_tasks.fetch_sub(1, std::memory_order_seq_cst) == 1)
+    {
+        // That was the last one, let waitForCompletion know
+        Threading::notifyWaiters();
+    }
+}
+
+TaskNode* newTaskNode(Threading::Task&& task, Threading::TaskGroup* group, std::uint64_t key)
+{
+    if (thread_arena != nullptr)
+    {
+        bool new_block;
+        void* memory = thread_arena->allocate(new_block);
+        if (new_block)
+        {
+            arena_blocks.fetch_add(1, std::memory_order_relaxed);
+        }
+        return new (memory) TaskNode {std::move(task), group, true, key};
+    }
+
+    heap_tasks.fetch_add(1, std::memory_order_relaxed);
+    return new TaskNode {std::move(task), group, false, key};
+}
+
+void queueThreaded(Threading::Task&& task, Threading::Priority priority, Threading::TaskGroup* group, std::uint64_t key)
+{
+    if (priority == Threading::Priority::Background)
+    {
+        pending_background.fetch_add(1, std::memory_order_relaxed);
+        queue_depth[priority].fetch_add(1, std::memory_order_relaxed);
+
+        tasks_lock.lock();
+        lesser_tasks.push(std::move(task));
+        tasks_lock.unlock();
+
+        lesser_available.notify_one();
+        return;
+    }
+
+    pending_tasks.fetch_add(1, std::memory_order_relaxed);
+    TaskNode* t = newTaskNode(std::move(task), group, key);
+
+    if (queue_index >= 0)
+    {
+        queues[queue_index]->by_priority[priority].push(t);
+    }
+    else
+    {
+        InjectedQueue& inject = injected[priority];
+        inject.lock.lock();
+        inject.tasks.push(t);
+        inject.count.fetch_add(1, std::memory_order_relaxed);
+        inject.lock.unlock();
+    }
+
+    queue_depth[priority].fetch_add(1, std::memory_order_relaxed);
+    queued_tasks.fetch_add(1, std::memory_order_seq_cst);
+    wakeSleeper();
+}
+
+void queueTask(Threading::Task&& task, Threading::Priority priority, Threading::TaskGroup* group)
+{
+    // Background tasks aren't part of a frame, so they aren't recorded
+    std::uint64_t key = 0;
+    if (tracing.load(std::memory_order_relaxed) && priority != Threading::Priority::Background)
+    {
+        key = nextTaskKey();
+
+        if (replaying.load(std::memory_order_relaxed))
+        {
+            // Held back until the main thread gets to it, see takeReplayTask
+            pending_tasks.fetch_add(1, std::memory_order_relaxed);
+            queueReplay(newTaskNode(std::move(task), group, key));
+            return;
+        }
+    }
+
+#ifndef ENGINE_NO_THREADING
+    if (running.load(std::memory_order_relaxed))
+    {
+        queueThreaded(std::move(task), priority, group, key);
+        return;
+    }
+#endif
+
+    // Threading is off, so just run it here
+    if (key != 0)
+    {
+        runKeyed(task, key);
+    }
+    else
+    {
+        task();
+    }
+    if (group != nullptr)
+    {
+        group->_end();
+    }
+}
+
+// Spins for a while looking for work, and parks the thread if none turns up.
+// `done` is checked under the lock before sleeping, and the thread returns as soon as it's true
+template<typename F>
+TaskNode* idleUntilWork(int index, std::minstd_rand& random, int& spin_limit, F done)
+{
+    std::uint64_t idle_start = profiling.load(std::memory_order_relaxed) ? nowNs() : 0;
+    TaskNode* task = nullptr;
+
+    for (int i = 0; i < spin_limit && task == nullptr && !done(); i++)
+    {
+        cpuRelax();
+        task = findTask(index, random);
+    }
 
-std::queue<Threading::Task> important_tasks;
-std::queue<Threading::Task> lesser_tasks;
-std::mutex tasks_lock;
+    if (task != nullptr)
+    {
+        spin_limit = std::min(spin_limit * 2, max_spin);
+    }
+    else
+    {
+        spin_limit = std::max(spin_limit / 2, min_spin);
 
-std::mutex free_lock;
+        while (task == nullptr && !done())
+        {
+            {
+                std::unique_lock<std::mutex> guard(sleep_lock);
+                sleeping_threads.fetch_add(1, std::memory_order_seq_cst);
+                work_available.wait(guard, [&]() {
+                    return queued_tasks.load(std::memory_order_seq_cst) > 0 || done();
+                });
+                sleeping_threads.fetch_sub(1, std::memory_order_seq_cst);
+            }
+            task = findTask(index, random);
+        }
+    }
 
-int free_threads;
-int total_threads;
+    if (idle_start != 0 && thread_stats != nullptr)
+    {
+        thread_stats->idle_ns.fetch_add(nowNs() - idle_start, std::memory_order_relaxed);
+    }
+    return task;
+}
 
-bool running = false;
+Threading::Settings current_settings;
 
-void Threading::startThreads()
+void Threading::startThreads(Settings settings)
 {
+    current_settings = settings;
+    main_thread = std::this_thread::get_id();
     pool = std::vector<std::thread>();
-    important_tasks = std::queue<Task>();
+    queues = std::vector<WorkerQueues*>();
     lesser_tasks = std::queue<Task>();
-    total_threads = 0;
-    free_threads = 0;
+    pending_tasks = 0;
+    pending_background = 0;
+    queued_tasks = 0;
+    arenas = std::vector<TaskArena*>();
+    for (int i = 0; i < 3; i++)
+    {
+        queue_depth[i] = 0;
+    }
+    stats = std::vector<StatsSlot*>();
+
+    // The main thread gets a queue as well, since it does most of the adding
+    queue_index = 0;
+    Memory::registerFrameThread();
 
 #ifndef ENGINE_NO_THREADING
-    int amount = std::thread::hardware_concurrency();
-    if (amount == 0)
+    if (settings.mode == Mode::Off)
+    {
+        // Every task runs on the thread that adds it
+        return;
+    }
+
+    int amount = settings.threads;
+    if (settings.mode == Mode::Auto)
+    {
+        amount = std::thread::hardware_concurrency();
+        if (amount == 0)
+        {
+            // This may or may not happen on windows
+            // Default to... 4...?
+            amount = 4;
+        }
+        amount -= settings.reserved;
+    }
+
+    // There's always at least the lesser thread
+    if (amount < 1)
     {
-        // This may or may not happen on windows
-        // Default to... 4...?
-        amount = 4;
+        amount = 1;
     }
 
     int lesser_threads = 1;
-    total_threads = amount - lesser_threads;
-    free_threads = total_threads;
     running = true;
 
+    queues.push_back(new WorkerQueues());
+    for (auto i = 0; i < amount - lesser_threads; i++)
+    {
+        queues.push_back(new WorkerQueues());
+    }
+
+    for (size_t i = 0; i < queues.size(); i++)
+    {
+        arenas.push_back(new TaskArena());
+    }
+    thread_arena = arenas[0];
+
+    // One stats slot per queue, plus the lesser threads at the end
+    for (auto i = 0; i < (int)queues.size() + lesser_threads; i++)
+    {
+        stats.push_back(new StatsSlot());
+    }
+    thread_stats = stats[0];
+
     // Thread-up
     for (auto i = 0; i < amount; i++)
     {
@@ -51,50 +881,155 @@ void Threading::startThreads()
             lesser_threads -= 1;
         }
         else {
-            pool.push_back(std::thread(threadWorker));
+            pool.push_back(std::thread(threadWorker, (int)pool.size()));
         }
     }
 #endif
 }
 
-void Threading::addTask(std::function<void()> function)
+void Threading::addTask(Task task, Priority priority)
 {
-#ifndef ENGINE_NO_THREADING
-    tasks_lock.lock();
-    Task t;
-    t.function = function;
-    important_tasks.push(t);
-    tasks_lock.unlock();
+    queueTask(std::move(task), priority, nullptr);
+}
+
+void Threading::addLesserTask(Task task)
+{
+    addTask(std::move(task), Priority::Background);
+}
+
+void Threading::_countHeapTask()
+{
+    heap_tasks.fetch_add(1, std::memory_order_relaxed);
+}
+
+Threading::TaskStats Threading::getTaskStats()
+{
+    TaskStats output;
+    output.heap_tasks = heap_tasks.load(std::memory_order_relaxed);
+    output.arena_blocks = arena_blocks.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < arenas.size(); i++)
+    {
+        output.arena_bytes += arenas[i]->getBytes();
+    }
+    return output;
+}
+
+Threading::Settings Threading::getSettings()
+{
+#ifdef ENGINE_NO_THREADING
+    Settings settings;
+    settings.mode = Mode::Off;
+    return settings;
 #else
-    function();
+    return current_settings;
 #endif
 }
 
-void Threading::addLesserTask(std::function<void()> function)
+int Threading::getThreadCount()
 {
 #ifndef ENGINE_NO_THREADING
-    tasks_lock.lock();
-    Task t;
-    t.function = function;
-    important_tasks.push(t);
-    tasks_lock.unlock();
-#else
-    function();
+    if (queues.size() > 0)
+    {
+        return (int)queues.size();
+    }
 #endif
+    return 1;
+}
+
+int Threading::getQueueDepth(Priority priority)
+{
+    return queue_depth[priority].load(std::memory_order_relaxed);
+}
+
+int Threading::getPendingBackgroundTasks()
+{
+    return pending_background.load(std::memory_order_relaxed);
+}
+
+void Threading::waitForBackground()
+{
+    waitUntil([]() {
+        return pending_background.load(std::memory_order_seq_cst) == 0;
+    });
 }
 
 void Threading::waitForCompletion()
 {
+    waitUntil([]() {
+        return pending_tasks.load(std::memory_order_seq_cst) == 0;
+    });
+
+    if (isMainThread())
+    {
+        endTraceFrame();
+    }
+
 #ifndef ENGINE_NO_THREADING
-    bool end = false;
-    while (!(end))
+    if (queue_index == 0)
     {
-        tasks_lock.lock();
-        if (important_tasks.empty() && total_threads == free_threads)
+        // Every frame task is done, so nothing can still be using the arenas
+        for (size_t i = 0; i < arenas.size(); i++)
         {
-            end = true;
+            arenas[i]->reset();
         }
-        tasks_lock.unlock();
+    }
+#endif
+}
+
+void Threading::waitUntil(std::function<bool()> done)
+{
+    if (replaying.load(std::memory_order_relaxed) && isMainThread())
+    {
+        // Everything runs here, one task at a time, in the recorded order
+        while (!done())
+        {
+            TaskNode* task = takeReplayTask();
+            if (task == nullptr)
+            {
+                // What we're waiting on isn't a frame task, so wait for it normally
+                break;
+            }
+            runTask(task);
+        }
+    }
+
+#ifndef ENGINE_NO_THREADING
+    if (!running.load(std::memory_order_relaxed))
+    {
+        // Nothing could be running anywhere else, so there's nothing to wait for
+        return;
+    }
+
+    std::minstd_rand random(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    static thread_local int spin_limit = min_spin;
+
+    // Help out instead of just sitting here
+    completion_waiters.fetch_add(1, std::memory_order_seq_cst);
+    while (!done())
+    {
+        TaskNode* task = findTask(queue_index, random);
+        if (task == nullptr)
+        {
+            // Everything left is already running somewhere else, so wait for it to finish
+            task = idleUntilWork(queue_index, random, spin_limit, done);
+        }
+
+        if (task != nullptr)
+        {
+            runTask(task);
+        }
+    }
+    completion_waiters.fetch_sub(1, std::memory_order_seq_cst);
+#endif
+}
+
+void Threading::notifyWaiters()
+{
+#ifndef ENGINE_NO_THREADING
+    if (completion_waiters.load(std::memory_order_seq_cst) > 0)
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        work_available.notify_all();
     }
 #endif
 }
@@ -103,6 +1038,17 @@ void Threading::cleanup()
 {
 #ifndef ENGINE_NO_THREADING
     running = false;
+
+    // Wake everyone up so they notice
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        work_available.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> guard(tasks_lock);
+        lesser_available.notify_all();
+    }
+
     for (size_t i = 0; i < pool.size(); i++)
     {
         if (pool[i].joinable())
@@ -110,43 +1056,55 @@ void Threading::cleanup()
             pool[i].join();
         }
     }
+
+    for (size_t i = 0; i < queues.size(); i++)
+    {
+        delete queues[i];
+    }
+    queues.clear();
+
+    thread_arena = nullptr;
+    for (size_t i = 0; i < arenas.size(); i++)
+    {
+        delete arenas[i];
+    }
+    arenas.clear();
+
+    thread_stats = nullptr;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        delete stats[i];
+    }
+    stats.clear();
 #endif
 }
 
-void Threading::threadWorker()
+void Threading::threadWorker(int index)
 {
 #ifndef ENGINE_NO_THREADING
-    Task current_task;
-    bool has_task = false;
+    queue_index = index;
+    thread_arena = arenas[index];
+    thread_stats = stats[index];
+    Memory::registerFrameThread();
+    std::minstd_rand random(index);
+    int spin_limit = min_spin;
+
+    auto stopped = []() {
+        return !running.load(std::memory_order_relaxed);
+    };
 
     // This is the function that runs on the threads
-    while (true)
+    while (running)
     {
-        if (running == false)
-        {
-            break;
-        }
-
-        tasks_lock.lock();
-        if (!important_tasks.empty())
+        TaskNode* task = findTask(index, random);
+        if (task == nullptr)
         {
-            current_task = important_tasks.front();
-            important_tasks.pop();
-            has_task = true;
-            free_lock.lock();
-            free_threads -= 1;
-            free_lock.unlock();
+            task = idleUntilWork(index, random, spin_limit, stopped);
         }
-        tasks_lock.unlock();
 
-        if (has_task == true)
+        if (task != nullptr)
         {
-            current_task.function();
-            has_task = false;
-
-            free_lock.lock();
-            free_threads += 1;
-            free_lock.unlock();
+            runTask(task);
         }
     }
 #endif
@@ -155,31 +1113,360 @@ void Threading::threadWorker()
 void Threading::lesserThreadWorker()
 {
 #ifndef ENGINE_NO_THREADING
+    thread_stats = stats.back();
     Task current_task;
-    bool has_task = false;
 
     // This is the function that runs on the threads
     while (true)
     {
-        if (running == false)
+        std::uint64_t idle_start = profiling.load(std::memory_order_relaxed) ? nowNs() : 0;
         {
-            break;
+            // Background work isn't urgent, so don't bother spinning
+            std::unique_lock<std::mutex> guard(tasks_lock);
+            lesser_available.wait(guard, []() {
+                return !lesser_tasks.empty() || !running;
+            });
+
+            if (running == false)
+            {
+                break;
+            }
+
+            current_task = std::move(lesser_tasks.front());
+            lesser_tasks.pop();
+            queue_depth[Threading::Priority::Background].fetch_sub(1, std::memory_order_relaxed);
         }
 
-        tasks_lock.lock();
-        if (!lesser_tasks.empty())
+        if (idle_start != 0)
         {
-            current_task = lesser_tasks.front();
-            lesser_tasks.pop();
-            has_task = true;
+            std::uint64_t start = nowNs();
+            thread_stats->idle_ns.fetch_add(start - idle_start, std::memory_order_relaxed);
+            current_task();
+            thread_stats->busy_ns.fetch_add(nowNs() - start, std::memory_order_relaxed);
+            thread_stats->tasks_run.fetch_add(1, std::memory_order_relaxed);
         }
-        tasks_lock.unlock();
+        else
+        {
+            current_task();
+        }
+        current_task = Task();
 
-        if (has_task == true)
+        if (pending_background.fetch_sub(1, std::memory_order_seq_cst) == 1)
         {
-            current_task.function();
-            has_task = false;
+            notifyWaiters();
         }
     }
 #endif
-}
\ No newline at end of file
+}
+
+// =============================================
+// Task groups and jobs
+
+Threading::TaskGroup::~TaskGroup()
+{
+    // Tasks hold a pointer to us, so we can't go anywhere until they're done
+    wait();
+}
+
+void Threading::TaskGroup::addTask(Task task, Priority priority)
+{
+    _begin();
+    if (priority == Priority::Background)
+    {
+        // Background tasks don't go through the queues, so they have to tell us themselves
+        queueTask([this, inner = std::move(task)]() mutable {
+            inner();
+            _end();
+        }, priority, nullptr);
+    }
+    else
+    {
+        queueTask(std::move(task), priority, this);
+    }
+}
+
+void Threading::TaskGroup::wait()
+{
+    waitUntil([this]() {
+        return isDone();
+    });
+}
+
+void Threading::TaskGroup::_begin()
+{
+    pending.fetch_add(1, std::memory_order_seq_cst);
+}
+
+void Threading::TaskGroup::_end()
+{
+    if (pending.fetch_sub(1, std::memory_order_seq_cst) == 1)
+    {
+        notifyWaiters();
+    }
+}
+
+Threading::Job::Job(Task func, TaskGroup* task_group): function(std::move(func)),
+group(task_group),
+waiting_on(1),
+lock(),
+dependents()
+{
+
+}
+
+std::shared_ptr<Threading::Job> Threading::createJob(Task function, TaskGroup* group)
+{
+    return std::make_shared<Job>(std::move(function), group);
+}
+
+void Threading::Job::dependsOn(std::shared_ptr<Job> other)
+{
+    std::lock_guard<std::mutex> guard(other->lock);
+    if (!other->finished)
+    {
+        waiting_on.fetch_add(1, std::memory_order_relaxed);
+        other->dependents.push_back(shared_from_this());
+    }
+}
+
+void Threading::Job::submit()
+{
+    if (group != nullptr)
+    {
+        group->_begin();
+    }
+    release();
+}
+
+void Threading::Job::release()
+{
+    if (waiting_on.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        // Nothing left to wait for
+        auto self = shared_from_this();
+        Threading::addTask([self]() {
+            self->run();
+        });
+    }
+}
+
+void Threading::Job::run()
+{
+    function();
+
+    std::vector<std::shared_ptr<Job>> ready;
+    lock.lock();
+    finished = true;
+    ready.swap(dependents);
+    lock.unlock();
+
+    for (size_t i = 0; i < ready.size(); i++)
+    {
+        ready[i]->release();
+    }
+
+    if (group != nullptr)
+    {
+        group->_end();
+    }
+}
+
+bool Threading::Job::isDone()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return finished;
+}
+
+void Threading::setProfiling(bool enabled)
+{
+    profiling = enabled;
+}
+
+bool Threading::getProfiling()
+{
+    return profiling;
+}
+
+std::vector<Threading::WorkerStats> Threading::getWorkerStats()
+{
+    std::vector<WorkerStats> output;
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        WorkerStats worker;
+        worker.busy_time = stats[i]->busy_ns.load(std::memory_order_relaxed) / 1e9;
+        worker.idle_time = stats[i]->idle_ns.load(std::memory_order_relaxed) / 1e9;
+        worker.tasks_run = stats[i]->tasks_run.load(std::memory_order_relaxed);
+        output.push_back(worker);
+    }
+    return output;
+}
+
+void Threading::resetWorkerStats()
+{
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        stats[i]->busy_ns = 0;
+        stats[i]->idle_ns = 0;
+        stats[i]->tasks_run = 0;
+    }
+}
+
+// ==============================================
+// Recording and replaying
+
+// The file written by startRecording. It's LZ4 compressed by the ResourceManager, and looks like this before that:
+// "ETRC", uint16 version, uint32 frame count, then for each frame a uint32 task count and that many TaskTraces
+class TaskRecording: public Res::IResource
+{
+    public:
+        static const glm::uint16 format_version = 1;
+        std::vector<TraceFrame> frames;
+
+        template<typename T>
+        static void write(std::shared_ptr<std::stringstream>& file, T value)
+        {
+            file->write(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+
+        template<typename T>
+        static bool read(std::shared_ptr<std::stringstream>& file, T& value)
+        {
+            file->read(reinterpret_cast<char*>(&value), sizeof(T));
+            return file->gcount() == sizeof(T);
+        }
+
+        virtual void saveFile(std::shared_ptr<std::stringstream> file)
+        {
+            file->write("ETRC", 4);
+            write<glm::uint16>(file, format_version);
+            write<glm::uint32>(file, (glm::uint32)frames.size());
+
+            for (size_t i = 0; i < frames.size(); i++)
+            {
+                write<glm::uint32>(file, (glm::uint32)frames[i].size());
+                for (size_t j = 0; j < frames[i].size(); j++)
+                {
+                    const Threading::TaskTrace& trace = frames[i][j];
+                    write<std::uint64_t>(file, trace.key);
+                    write<glm::int16>(file, (glm::int16)trace.thread);
+                    write<glm::uint32>(file, trace.start);
+                    write<glm::uint32>(file, trace.duration);
+                }
+            }
+        }
+
+        virtual void loadFile(std::shared_ptr<std::stringstream> file)
+        {
+            frames.clear();
+
+            char magic[4];
+            glm::uint16 version;
+            glm::uint32 frame_count;
+            file->read(magic, 4);
+            if (file->gcount() != 4 || std::string(magic, 4) != "ETRC" || !read(file, version) || version != format_version || !read(file, frame_count))
+            {
+                LOG_ERROR("Not a task recording, or it's from a different version");
+                return;
+            }
+
+            for (glm::uint32 i = 0; i < frame_count; i++)
+            {
+                glm::uint32 task_count;
+                if (!read(file, task_count))
+                {
+                    LOG_ERROR("Task recording is truncated");
+                    frames.clear();
+                    return;
+                }
+
+                TraceFrame frame;
+                for (glm::uint32 j = 0; j < task_count; j++)
+                {
+                    Threading::TaskTrace trace;
+                    glm::int16 thread;
+                    if (!read(file, trace.key) || !read(file, thread) || !read(file, trace.start) || !read(file, trace.duration))
+                    {
+                        LOG_ERROR("Task recording is truncated");
+                        frames.clear();
+                        return;
+                    }
+                    trace.thread = thread;
+                    frame.push_back(trace);
+                }
+                frames.push_back(frame);
+            }
+        }
+};
+
+void saveRecording()
+{
+    auto file = std::make_shared<TaskRecording>();
+    file->frames.swap(recorded_frames);
+    Res::ResourceManager::save(record_filename, file, true, Res::FileType::binary);
+
+    LOG_SUCCESS("Recorded " + std::to_string(file->frames.size()) + " frames of tasks to " + record_filename);
+    recording = false;
+}
+
+void Threading::startRecording(std::string filename, int frames)
+{
+    if (tracing.load() || frames <= 0)
+    {
+        LOG_ERROR("Can't start recording: already recording or replaying, or no frames were asked for");
+        return;
+    }
+
+    record_filename = filename;
+    record_frames_left = frames;
+    recorded_frames.clear();
+    trace_events.clear();
+
+    recording = true;
+    tracing = true;
+    frame_start = nowNs();
+}
+
+bool Threading::isRecording()
+{
+    return recording.load();
+}
+
+bool Threading::startReplay(std::string filename)
+{
+    if (tracing.load())
+    {
+        LOG_ERROR("Can't start replaying: already recording or replaying");
+        return false;
+    }
+
+    auto file = Res::ResourceManager::load<TaskRecording>(filename, true, Res::FileType::binary, true);
+    if (file == nullptr || file->frames.size() == 0)
+    {
+        LOG_ERROR("Could not replay " + filename);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(replay_lock);
+        replay_frames.swap(file->frames);
+        replay_frame = 0;
+        replay_pending.clear();
+        startReplayFrame();
+    }
+    trace_events.clear();
+
+    replaying = true;
+    tracing = true;
+    frame_start = nowNs();
+    return true;
+}
+
+bool Threading::isReplaying()
+{
+    return replaying.load();
+}
+
+std::vector<Threading::TaskTrace> Threading::getLastFrameTrace()
+{
+    return last_frame_trace;
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include "Engine/Engine.hpp"
 #include "Engine/Res.hpp"
+#include "Engine/Scene.hpp"
 #include "Engine/Tools/AssimpImporter.hpp"
 
 int main(int argc, char const *argv[]) 
@@ -8,9 +9,6 @@ int main(int argc, char const *argv[])
     // Start Engine
     Engine::Res::ResourceManager::start(argc, argv);
 
-    assimp_import("../../assets/backpack.glb");
-    return 0;
-
     std::string command;
     // Get argv
     if (argc < 2)
@@ -39,6 +37,7 @@ int main(int argc, char const *argv[])
         std::cout << "Commands: " << std::endl;
         std::cout << "\thelp - Show this message" << std::endl;
         std::cout << "\timport <filename> - Convert the given 3D model into Engine's format" << std::endl;
+        std::cout << "\tconvert <input> <output> - Convert a scene from XML to the binary format, or from binary back to XML" << std::endl;
     }
     else if (command == "import")
     {
@@ -51,6 +50,34 @@ int main(int argc, char const *argv[])
             assimp_import(std::string(argv[2]));
         }
     }
+    else if (command == "convert")
+    {
+        if (argc < 4)
+        {
+            std::cout << "Needs input and output files" << std::endl;
+        }
+        else
+        {
+            auto input = Engine::Res::ResourceManager::load<Engine::Res::TextResource>(std::string(argv[2]));
+            if (input == nullptr)
+            {
+                return 1;
+            }
+
+            // Whichever format the input is, the output is the other one
+            std::string output;
+            bool to_binary = !Engine::Scene::isBinaryScene(input->getText());
+            bool converted = to_binary ? Engine::Scene::xmlToBinary(input->getText(), output) : Engine::Scene::binaryToXML(input->getText(), output);
+            if (!converted)
+            {
+                return 1;
+            }
+
+            auto res = std::make_shared<Engine::Res::TextResource>();
+            res->setText(output);
+            Engine::Res::ResourceManager::save(std::string(argv[3]), res, false, to_binary ? Engine::Res::FileType::binary : Engine::Res::FileType::text);
+        }
+    }
     else
     {
         std::cout << "Invalid command \"" + command +"\"" << std::endl;
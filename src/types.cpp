@@ -0,0 +1,58 @@
+#include "Engine/Engine.hpp"
+#include <deque>
+#include <mutex>
+
+using namespace Engine::Types;
+
+// Function statics, since elements can be made while other files' globals are being constructed
+std::mutex& getTypeSetsLock()
+{
+    static std::mutex lock;
+    return lock;
+}
+
+// Sets live in a deque so they never move, which is what lets containers point straight at them
+std::deque<TypeSet>& getTypeSets()
+{
+    static std::deque<TypeSet> sets(1);
+    return sets;
+}
+
+const TypeSet* TypeSet::getEmpty()
+{
+    static const TypeSet* empty = &getTypeSets()[0];
+    return empty;
+}
+
+const TypeSet* TypeSet::with(int type) const
+{
+    if (type < 0)
+    {
+        LOG_ERROR("Error: Types can't be negative");
+        return this;
+    }
+
+    std::lock_guard<std::mutex> guard(getTypeSetsLock());
+
+    auto found = extended.find(type);
+    if (found != extended.end())
+    {
+        return found->second;
+    }
+
+    // Elements with the same tags always get them in the same order, so this is one new set per element class
+    auto& sets = getTypeSets();
+    sets.emplace_back();
+    TypeSet& output = sets.back();
+    output.types = types;
+    output.types.push_back(type);
+    output.bits = bits;
+    if ((size_t)type / 64 >= output.bits.size())
+    {
+        output.bits.resize((size_t)type / 64 + 1, 0);
+    }
+    output.bits[type / 64] |= (glm::uint64)1 << (type % 64);
+
+    extended[type] = &output;
+    return &output;
+}